@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+"""
+BDF フォントを draw_matrix 用の形式に変換する
+(draw_matrix.cc の PackedFont が mmap して読む。make で fonts/*.bdf から作る)
+
+使い方: python3 compile_font.py fonts/BestTen-DOT.bdf fonts/BestTen-DOT.pbf
+        python3 compile_font.py --subset draw_matrix.cc --subset fonts/embed_chars.txt --header \
+            fonts/BestTen-DOT.bdf embedded_font.h
+
+--subset を付けると、かな・英数字・記号と、指定したファイルに出てくる文字だけに絞る
+(.cc/.py は文字列リテラル、.json はキーと文字列、それ以外はファイル全体。# で始まる行は除く)。
+フォントにない文字の代わりに描く四角 (U+FFFD) がなければ作って加える。
+--header を付けると、同じ形式を C++ の配列 EMBEDDED_FONT として書き出す (make EMBED_FONT=1 で埋め込む)
+
+形式 (リトルエンディアン):
+  ヘッダ 24 バイト : "PBF1", height (int16), baseline (int16),
+                     range_count, glyph_count, bitmap_bytes, 予約 (uint32)
+  範囲 12 バイト   : first_cp, count, first_glyph (uint32)。コードポイントの連続した区間を昇順に
+  グリフ 8 バイト  : offset (uint32), device_width (uint8), height (uint8), y_offset (int8), 予約 (uint8)
+  ビットマップ     : グリフごとに device_width x height ビットを行の順に詰める (MSB から、バイト境界から始める)
+"""
+
+import argparse
+import json
+import os
+import re
+import struct
+import sys
+from typing import Dict, Iterable, List, Set, Tuple
+
+MAGIC = b"PBF1"
+# rgb_matrix::Font の1行分のビット幅 (これより広い送り幅は切り詰められる)
+ROW_BITS = 64
+MAX_CODEPOINT = 0x10FFFF
+REPLACEMENT_CODEPOINT = 0xFFFD
+# 四角の大きさの基準にする字 (あ)
+REFERENCE_CODEPOINT = 0x3042
+
+# 絞り込むときも必ず入れる範囲 (ASCII, 記号, 矢印, 図形, 句読点・かな, 全角英数字)
+BASE_RANGES = [
+    (0x0020, 0x007E),
+    (0x2010, 0x203F),
+    (0x2190, 0x2193),
+    (0x25A0, 0x25FF),
+    (0x3000, 0x30FF),
+    (0xFF01, 0xFF5E),
+]
+
+# 1行の文字列リテラル ("..." / '...')
+STRING_LITERAL = re.compile(r'"((?:[^"\\\n]|\\.)*)"|\'((?:[^\'\\\n]|\\.)*)\'')
+
+# コードポイント -> (device_width, height, y_offset, 各行の表示ビット列)
+Glyph = Tuple[int, int, int, List[int]]
+
+
+def glyph_rows(rows: List[int], width: int, x_offset: int, device_width: int) -> List[int]:
+    """BDF の行 (左詰めの16進) を rgb_matrix::Font と同じく x_offset だけずらし、表示する device_width ビットにする"""
+    shift = 8 * (ROW_BITS // 8 - (width + 7) // 8) - x_offset
+    mask = (1 << ROW_BITS) - 1
+    packed = []
+    for value in rows:
+        bits = (value << shift) & mask if shift >= 0 else value >> -shift
+        packed.append(bits >> (ROW_BITS - device_width) if device_width > 0 else 0)
+    return packed
+
+
+def parse_bdf(path: str) -> Tuple[int, int, Dict[int, Glyph]]:
+    """rgb_matrix::Font::LoadFont と同じ規則で BDF を読む"""
+    height = baseline = 0
+    glyphs: Dict[int, Glyph] = {}
+    codepoint = 0
+    device_width = 0
+    bbx = (0, 0, 0, 0)
+    rows: List[int] = []
+    in_bitmap = False
+    in_glyph = False
+
+    with open(path, "r", encoding="latin-1") as f:
+        for line in f:
+            words = line.split()
+            if not words:
+                continue
+            key = words[0]
+            if key == "FONTBOUNDINGBOX" and len(words) >= 5:
+                height = int(words[2])
+                baseline = height + int(words[4])
+            elif key == "ENCODING" and len(words) >= 2:
+                codepoint = int(words[1])
+            elif key == "DWIDTH" and len(words) >= 3:
+                device_width = min(int(words[1]), ROW_BITS)
+            elif key == "BBX" and len(words) >= 5:
+                bbx = tuple(int(w) for w in words[1:5])
+                rows = []
+                in_bitmap = False
+                in_glyph = True
+            elif key == "BITMAP":
+                in_bitmap = True
+            elif key == "ENDCHAR":
+                width, glyph_height, x_offset, y_offset = bbx
+                # 行が足りないグリフは登録しない
+                if in_glyph and in_bitmap and len(rows) == glyph_height and 0 <= codepoint <= MAX_CODEPOINT:
+                    glyphs[codepoint] = (device_width, glyph_height, y_offset,
+                                         glyph_rows(rows, width, x_offset, device_width))
+                in_glyph = False
+                in_bitmap = False
+            elif in_bitmap and len(rows) < bbx[1]:
+                try:
+                    rows.append(int(key, 16))
+                except ValueError:
+                    pass
+    return height, baseline, glyphs
+
+
+def pack_bits(device_width: int, rows: List[int]) -> bytes:
+    """各行の device_width ビットを MSB から詰める"""
+    value = 0
+    count = 0
+    for row in rows:
+        value = (value << device_width) | row
+        count += device_width
+    pad = (-count) % 8
+    return (value << pad).to_bytes((count + pad) // 8, "big") if count else b""
+
+
+def compile_font(height: int, baseline: int, glyphs: Dict[int, Glyph]) -> bytes:
+    codepoints = sorted(glyphs)
+    ranges: List[Tuple[int, int, int]] = []
+    for index, cp in enumerate(codepoints):
+        if ranges and ranges[-1][0] + ranges[-1][1] == cp:
+            first, count, first_glyph = ranges[-1]
+            ranges[-1] = (first, count + 1, first_glyph)
+        else:
+            ranges.append((cp, 1, index))
+
+    records = bytearray()
+    bitmap = bytearray()
+    for cp in codepoints:
+        device_width, glyph_height, y_offset, rows = glyphs[cp]
+        if glyph_height > 255 or not -128 <= y_offset <= 127:
+            raise ValueError(f"glyph U+{cp:04X} is too large for the packed format")
+        records += struct.pack("<IBBbB", len(bitmap), device_width, glyph_height, y_offset, 0)
+        bitmap += pack_bits(device_width, rows)
+
+    out = bytearray(struct.pack("<4shhIIII", MAGIC, height, baseline, len(ranges), len(codepoints), len(bitmap), 0))
+    for first, count, first_glyph in ranges:
+        out += struct.pack("<III", first, count, first_glyph)
+    out += records
+    out += bitmap
+    return bytes(out)
+
+
+def json_strings(value) -> Iterable[str]:
+    """json のキーと文字列をすべて返す"""
+    if isinstance(value, str):
+        yield value
+    elif isinstance(value, dict):
+        for key, item in value.items():
+            yield key
+            yield from json_strings(item)
+    elif isinstance(value, list):
+        for item in value:
+            yield from json_strings(item)
+
+
+def subset_chars(path: str) -> Set[int]:
+    """path に出てくる表示しうる文字のコードポイント"""
+    with open(path, "r", encoding="utf-8") as f:
+        text = f.read()
+    ext = os.path.splitext(path)[1]
+    if ext == ".json":
+        try:
+            strings = list(json_strings(json.loads(text)))
+        except ValueError:
+            # 書き込み途中などで壊れていれば全体を使う
+            strings = [text]
+    elif ext in (".cc", ".h", ".py"):
+        strings = [a or b for a, b in STRING_LITERAL.findall(text)]
+    else:
+        strings = [line for line in text.splitlines() if not line.startswith("#")]
+    return {ord(c) for s in strings for c in s}
+
+
+def fallback_box(glyphs: Dict[int, Glyph], height: int, baseline: int) -> Glyph:
+    """フォントにない文字の代わりに描く四角。あ と同じ大きさ (なければ全体の大きさ) にする"""
+    if REFERENCE_CODEPOINT in glyphs:
+        device_width, box_height, y_offset, _ = glyphs[REFERENCE_CODEPOINT]
+    else:
+        device_width, box_height, y_offset = max(1, height // 2), height, baseline - height
+    width = max(1, device_width - 1)
+    edge = ((1 << width) - 1) << (device_width - width)
+    side = (1 << (device_width - 1)) | (1 << (device_width - width))
+    rows = [edge if r in (0, box_height - 1) else side for r in range(box_height)]
+    return device_width, box_height, y_offset, rows
+
+
+def subset_font(glyphs: Dict[int, Glyph], height: int, baseline: int, paths: List[str]) -> Dict[int, Glyph]:
+    wanted: Set[int] = set()
+    for first, last in BASE_RANGES:
+        wanted.update(range(first, last + 1))
+    for path in paths:
+        wanted |= subset_chars(path)
+    subset = {cp: glyphs[cp] for cp in sorted(wanted) if cp in glyphs}
+    if REPLACEMENT_CODEPOINT not in subset:
+        subset[REPLACEMENT_CODEPOINT] = fallback_box(glyphs, height, baseline)
+    return subset
+
+
+def write_header(f, data: bytes, source: str, glyph_count: int) -> None:
+    f.write(f"// compile_font.py が {source} から作ったファイル ({glyph_count} 字, {len(data)} バイト)。編集しない\n")
+    f.write("#pragma once\n\n")
+    f.write("alignas(4) constexpr uint8_t EMBEDDED_FONT[] = {\n")
+    for i in range(0, len(data), 16):
+        f.write("    " + ", ".join(f"0x{b:02x}" for b in data[i:i + 16]) + ",\n")
+    f.write("};\n")
+
+
+def main(argv: List[str]) -> int:
+    parser = argparse.ArgumentParser(prog=os.path.basename(argv[0]),
+                                     description="BDF フォントを draw_matrix 用の形式に変換する")
+    parser.add_argument("input", help="BDF フォント")
+    parser.add_argument("output", help="出力先 (.pbf または --header のときは .h)")
+    parser.add_argument("--subset", action="append", metavar="FILE",
+                        help="かな・英数字・記号と FILE に出てくる文字だけに絞る (複数指定可)")
+    parser.add_argument("--header", action="store_true", help="C++ のヘッダとして書き出す")
+    args = parser.parse_args(argv[1:])
+
+    height, baseline, glyphs = parse_bdf(args.input)
+    if height <= 0 or not glyphs:
+        print(f"{args.input}: no glyphs found", file=sys.stderr)
+        return 1
+    if args.subset:
+        glyphs = subset_font(glyphs, height, baseline, args.subset)
+    data = compile_font(height, baseline, glyphs)
+    # 途中で止まっても壊れたファイルが残らないように、書き終えてから置き換える
+    tmp = args.output + ".tmp"
+    if args.header:
+        with open(tmp, "w", encoding="utf-8") as f:
+            write_header(f, data, args.input, len(glyphs))
+    else:
+        with open(tmp, "wb") as f:
+            f.write(data)
+    os.replace(tmp, args.output)
+    print(f"{args.output}: {len(glyphs)} glyphs, {len(data)} bytes")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
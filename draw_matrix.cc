@@ -5,389 +5,4333 @@
 #include "led-matrix.h"
 #include "graphics.h"
 #include "json.hpp" // nlohmann/json
+#ifdef EMBED_FONT
+#include "embedded_font.h" // make EMBED_FONT=1 で compile_font.py が作る
+#endif
 
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <functional>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <ctime>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <cctype>
 #include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <string_view>
+#include <initializer_list>
 
 using namespace rgb_matrix;
 using json = nlohmann::json;
 
+// --- 入力 JSON のアリーナ ---
+// 読み込みのたびに DOM の小さな節点と文字列を確保し、前回の分を解放するのを何か月も繰り返すと
+// ヒープが断片化する。入力の解析結果はファイル1つの1回分ごとに専用のアリーナへ置き、
+// 差し替えで不要になったらアリーナごと (mmap した塊をまとめて) 返す
+const size_t ARENA_MIN_CHUNK = 16 * 1024;
+
+class JsonArena
+{
+public:
+    // size_hint: 前回の同じファイルで使った大きさ。たいてい最初の塊1つで足りる
+    explicit JsonArena(size_t size_hint = 0) : next_chunk_(std::max(ARENA_MIN_CHUNK, size_hint)) {}
+    ~JsonArena()
+    {
+        for (const Chunk &c : chunks_)
+        {
+            munmap(c.base, c.size);
+            mapped_bytes() -= static_cast<long>(c.size);
+        }
+    }
+    JsonArena(const JsonArena &) = delete;
+    JsonArena &operator=(const JsonArena &) = delete;
+
+    // 個別には解放しない (アリーナを捨てるときにまとめて返す)
+    void *allocate(size_t bytes)
+    {
+        const size_t align = alignof(std::max_align_t);
+        bytes = (bytes + align - 1) & ~(align - 1);
+        if (chunks_.empty() || chunks_.back().size - chunks_.back().used < bytes)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            size_t size = std::max(next_chunk_, bytes);
+            size = (size + page - 1) / page * page;
+            void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED)
+                throw std::bad_alloc();
+            chunks_.push_back({static_cast<char *>(base), size, 0});
+            mapped_bytes() += static_cast<long>(size);
+            next_chunk_ = size * 2;
+        }
+        Chunk &c = chunks_.back();
+        void *p = c.base + c.used;
+        c.used += bytes;
+        used_ += bytes;
+        return p;
+    }
+
+    size_t used() const { return used_; }
+
+    // 全アリーナが確保している大きさ (統計用)
+    static std::atomic<long> &mapped_bytes()
+    {
+        static std::atomic<long> bytes{0};
+        return bytes;
+    }
+
+    // このスレッドで確保先にしているアリーナ (なければ通常のヒープ)
+    static JsonArena *&current()
+    {
+        static thread_local JsonArena *arena = nullptr;
+        return arena;
+    }
+
+    // 範囲内で作った input_json の節点と文字列を arena から取る
+    class Scope
+    {
+    public:
+        explicit Scope(JsonArena *arena) : prev_(current()) { current() = arena; }
+        ~Scope() { current() = prev_; }
+
+    private:
+        JsonArena *prev_;
+    };
+
+private:
+    struct Chunk
+    {
+        char *base;
+        size_t size;
+        size_t used;
+    };
+    std::vector<Chunk> chunks_;
+    size_t next_chunk_;
+    size_t used_ = 0;
+};
+
+// nlohmann::json は確保のたびに allocator を作り直すので状態を持てない。
+// 確保先は JsonArena::current() で決め、どこから取ったかを先頭に書いておく。
+// 描画スレッドで写しを作ったときなど、アリーナ外で確保したものだけ個別に解放する
+template <class T>
+struct ArenaAllocator
+{
+    using value_type = T;
+    static constexpr size_t HEADER = alignof(std::max_align_t);
+
+    ArenaAllocator() = default;
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        size_t bytes = HEADER + n * sizeof(T);
+        JsonArena *arena = JsonArena::current();
+        char *p = static_cast<char *>(arena ? arena->allocate(bytes) : ::operator new(bytes));
+        *reinterpret_cast<JsonArena **>(p) = arena;
+        return reinterpret_cast<T *>(p + HEADER);
+    }
+
+    void deallocate(T *ptr, size_t)
+    {
+        char *p = reinterpret_cast<char *>(ptr) - HEADER;
+        if (*reinterpret_cast<JsonArena **>(p) == nullptr)
+            ::operator delete(p);
+    }
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U> &) const { return true; }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U> &) const { return false; }
+};
+
+using arena_string = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+using input_json = nlohmann::basic_json<std::map, std::vector, arena_string, bool, std::int64_t, std::uint64_t,
+                                        double, ArenaAllocator>;
+
 // --- 定数・設定 ---
-const std::string FONT_FILE = "fonts/BestTen-DOT.bdf";
-const std::string DEPARTURE_FILE = "information_json_files/departure.json";
-const std::string OPERATION_FILE = "information_json_files/operation.json";
-const std::string WEATHER_FILE = "information_json_files/weather_forecast.json";
+// 以下は既定値。起動時に設定ファイルで上書きし、SIGHUP で再起動せずに再読み込みする
+const std::string CONFIG_FILE = "draw_matrix_config.json";
+const int MAX_RENDER_PRIORITY = 98; // パネル更新スレッド (99) より下
 
-// 終了シグナル処理
-volatile bool interrupt_received = false;
-static void InterruptHandler(int signo)
+// パネル設定 ("matrix")
+struct MatrixConfig
 {
-    interrupt_received = true;
-}
+    std::string hardware_mapping = "regular";
+    int rows = 32;
+    int cols = 128;
+    int chain_length = 1;
+    int parallel = 1;
+    int pwm_bits = 11;
+    int pwm_lsb_nanoseconds = 130;
+    int brightness = 100;
+    int limit_refresh_rate_hz = 0; // 0: 制限なし
+    int gpio_slowdown = 1;
+    bool drop_privileges = true; // false にするとパネル構成の変更も再起動なしで反映できる
+
+    // Matrix の作り直しが必要な項目が同じか (brightness と pwm_bits は実行中に変更できる)
+    bool same_hardware(const MatrixConfig &o) const
+    {
+        return hardware_mapping == o.hardware_mapping && rows == o.rows && cols == o.cols &&
+               chain_length == o.chain_length && parallel == o.parallel &&
+               pwm_lsb_nanoseconds == o.pwm_lsb_nanoseconds &&
+               limit_refresh_rate_hz == o.limit_refresh_rate_hz && gpio_slowdown == o.gpio_slowdown &&
+               drop_privileges == o.drop_privileges;
+    }
+};
+
+struct Config
+{
+    MatrixConfig matrix;
+
+    // 入力ファイル ("files")
+    std::string font_file = "fonts/BestTen-DOT.pbf"; // BDF か compile_font.py で変換したもの
+    std::string departure_file = "information_json_files/departure.json";
+    std::string operation_file = "information_json_files/operation.json";
+    std::string weather_file = "information_json_files/weather_forecast.json";
+    std::string first_last_file = "information_json_files/first_last_train.json";
+
+    // 表示タイミング ("timing")
+    int toggle_seconds = 5;  // A面/B面の切替間隔
+    int reload_seconds = 2;  // データ読み込み間隔
+    int scroll_frame_ms = 20; // スクロール中のフレーム間隔
+    int page_seconds = 10;    // 方面が表示行数より多いときのページ切替間隔
+    int marquee_step_ms = 50; // 枠に収まらない種別・行先を1pxずらす間隔
+
+    // 残り時間の色分け ("departure")
+    int red_minutes = 17;    // これ以下は赤 (駅まで走れ)
+    int yellow_minutes = 20; // これ以下は黄 (今すぐ出発)
+    std::map<std::string, int> pinned_rows; // 方面名 → 固定する行 (0: 最上段)。それ以外は発車時刻順
+
+    // レイアウト ("layout")
+    int line_height = 0; // 1行の高さ(px)。0: フォントから決める
+
+    // メッセージ帯 ("ticker")
+    bool ticker_ribbon = true;              // true: メッセージを区切りでつないで途切れなく流す
+    std::string ticker_separator = "　◆　"; // メッセージ間の区切り
+    std::vector<std::pair<std::string, std::string>> highlight_words = {
+        {"人身事故", "red"}, {"運転見合わせ", "red"}, {"運転を見合わせ", "red"},
+        {"振替輸送", "cyan"}, {"運転再開", "green"}, {"運転を再開", "green"}}; // 色を変えるキーワード → 色名
+    std::string highlight_route_lines = "cyan"; // 発車情報に出てくる路線名の色 ("": 色を変えない)
+
+    // 運行情報 ("operation")
+    std::vector<std::string> watch_lines; // 経路外でも知らせたい路線 (乗換先など)
+    bool show_elsewhere = false;          // 経路にも watch_lines にもない路線の遅延・見合わせも流すか
+
+    // 夜間モード ("night")
+    bool night_enabled = true;
+    int last_train_grace_minutes = 5;   // 終電発車から夜間モードに入るまでの猶予
+    int wake_before_first_minutes = 30; // 始発の何分前に通常表示へ戻るか
+    bool night_blank = false;           // true: 消灯 / false: 時計のみ表示
+    int night_reload_seconds = 60;      // 夜間のデータ読み込み間隔
+
+    // スレッド ("threads")。CPU 番号 -1 はパネル更新用のコア以外のどこでも動かす
+    int render_cpu = 2;      // 描画スレッドのコア
+    int loader_cpu = 1;      // 入力ファイルの読み込み・解析スレッドのコア
+    int render_priority = 0; // 描画スレッドの SCHED_FIFO 優先度 (1〜98。0: 通常のスケジューリング)
+
+    // 制御用ソケット ("control")
+    std::string control_socket; // 統計の取得・制御コマンドを受ける Unix ソケットのパス ("": 使わない)
+    std::string heartbeat;      // 生存確認用の共有メモリの名前 (/dev/shm 以下。"": 使わない)
+
+    // トレース ("trace")
+    bool trace_enabled = false;      // フレーム・読み込みの各段階を記録する
+    int trace_frame_budget_ms = 0;   // これより長いフレームがあれば記録を書き出す (0: 自動では書き出さない)
+    std::string trace_dir = "/tmp";  // 書き出し先
+};
+Config config;
 
 // 色定義
 struct ColorRGB
 {
     uint8_t r, g, b;
 };
-const ColorRGB COL_BLACK = {0, 0, 0};
-const ColorRGB COL_WHITE = {255, 255, 255};
-const ColorRGB COL_RED = {255, 0, 0};
-const ColorRGB COL_GREEN = {0, 255, 0};
-const ColorRGB COL_BLUE = {0, 0, 255};
-const ColorRGB COL_MAGENTA = {255, 0, 255};
-const ColorRGB COL_ORANGE = {255, 172, 0};
-const ColorRGB COL_YELLOW = {255, 255, 0};
-const ColorRGB COL_CYAN = {0, 255, 255};
-
-// 列車種別ごとの色マップ
-std::vector<std::pair<std::string, ColorRGB>> type_color_map = {
-    {"快速急行", COL_ORANGE},
-    {"通勤特快", COL_MAGENTA},
-    {"中央特快", COL_BLUE},
+constexpr ColorRGB COL_BLACK = {0, 0, 0};
+constexpr ColorRGB COL_WHITE = {255, 255, 255};
+constexpr ColorRGB COL_RED = {255, 0, 0};
+constexpr ColorRGB COL_GREEN = {0, 255, 0};
+constexpr ColorRGB COL_BLUE = {0, 0, 255};
+constexpr ColorRGB COL_MAGENTA = {255, 0, 255};
+constexpr ColorRGB COL_ORANGE = {255, 172, 0};
+constexpr ColorRGB COL_YELLOW = {255, 255, 0};
+constexpr ColorRGB COL_CYAN = {0, 255, 255};
+
+// 列車種別ごとの色 (get_train_info.py の TRAIN_TYPES と同じ語彙 + 「各駅」)
+struct TypeColor
+{
+    std::string_view name;
+    ColorRGB color;
+};
+constexpr TypeColor TRAIN_TYPE_COLORS[] = {
+    {"ホリデー快速おくたま", COL_RED},
+    {"ホリデー快速あきがわ", COL_RED},
+    {"エアポート快特", COL_WHITE},
+    {"アクセス特急", COL_RED},
+    {"S-TRAIN", COL_WHITE},
+    {"TJライナー", COL_WHITE},
+    {"F-LINER", COL_WHITE},
+    {"Fライナー", COL_WHITE},
     {"区間快速", COL_GREEN},
-    {"各駅停車", COL_BLUE},
+    {"通勤快速", COL_RED},
+    {"中央特快", COL_BLUE},
+    {"青梅特快", COL_MAGENTA},
+    {"特別快速", COL_RED},
+    {"通勤特快", COL_MAGENTA},
     {"新快速", COL_BLUE},
+    {"区間急行", COL_RED},
+    {"区間準急", COL_GREEN},
+    {"通勤準急", COL_GREEN},
+    {"快速急行", COL_ORANGE},
+    {"各駅停車", COL_BLUE},
+    {"各停", COL_BLUE},
+    {"快速", COL_RED},
     {"特快", COL_MAGENTA},
-    {"特急", COL_RED},
     {"急行", COL_RED},
-    {"快速", COL_RED},
     {"準急", COL_GREEN},
+    {"特急", COL_RED},
     {"普通", COL_GREEN},
-    {"各駅", COL_BLUE},
-    {"各停", COL_BLUE}};
+    {"各駅", COL_BLUE}};
+constexpr size_t TRAIN_TYPE_COUNT = sizeof(TRAIN_TYPE_COLORS) / sizeof(TRAIN_TYPE_COLORS[0]);
+
+// 種別名の完全一致はコンパイル時に作る完全ハッシュ表で引く。
+// seed を変えながら FNV-1a で全種別が別々の枠に入るものを探す
+constexpr size_t TYPE_TABLE_SIZE = 128; // 2のべき乗
+
+constexpr uint32_t type_hash(std::string_view name, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : name)
+    {
+        h ^= static_cast<uint8_t>(c);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+constexpr uint32_t find_type_seed()
+{
+    for (uint32_t seed = 1; seed < 100000; ++seed)
+    {
+        bool used[TYPE_TABLE_SIZE] = {};
+        bool ok = true;
+        for (size_t i = 0; i < TRAIN_TYPE_COUNT && ok; ++i)
+        {
+            size_t slot = type_hash(TRAIN_TYPE_COLORS[i].name, seed) & (TYPE_TABLE_SIZE - 1);
+            ok = !used[slot];
+            used[slot] = true;
+        }
+        if (ok)
+            return seed;
+    }
+    return 0;
+}
+constexpr uint32_t TYPE_SEED = find_type_seed();
+static_assert(TYPE_SEED != 0, "no collision-free seed for TRAIN_TYPE_COLORS");
+
+struct TypeTable
+{
+    uint8_t slots[TYPE_TABLE_SIZE] = {}; // 0: 空き / i+1: TRAIN_TYPE_COLORS[i]
+    uint8_t longest_first[TRAIN_TYPE_COUNT] = {}; // 部分一致で試す順 (名前の長い順)
+};
+
+constexpr TypeTable build_type_table()
+{
+    TypeTable t;
+    for (size_t i = 0; i < TRAIN_TYPE_COUNT; ++i)
+    {
+        t.slots[type_hash(TRAIN_TYPE_COLORS[i].name, TYPE_SEED) & (TYPE_TABLE_SIZE - 1)] = static_cast<uint8_t>(i + 1);
+
+        // 挿入ソート (同じ長さなら一覧の順)
+        size_t j = i;
+        while (j > 0 && TRAIN_TYPE_COLORS[t.longest_first[j - 1]].name.size() < TRAIN_TYPE_COLORS[i].name.size())
+        {
+            t.longest_first[j] = t.longest_first[j - 1];
+            --j;
+        }
+        t.longest_first[j] = static_cast<uint8_t>(i);
+    }
+    return t;
+}
+constexpr TypeTable TYPE_TABLE = build_type_table();
+
+// 一覧にある種別ならその添字、なければ -1
+constexpr int lookup_train_type(std::string_view name)
+{
+    int index = TYPE_TABLE.slots[type_hash(name, TYPE_SEED) & (TYPE_TABLE_SIZE - 1)] - 1;
+    return (index >= 0 && TRAIN_TYPE_COLORS[index].name == name) ? index : -1;
+}
+static_assert(lookup_train_type("快速急行") >= 0 && lookup_train_type("快速急") < 0, "type table broken");
+
+Color ToMatrixColor(const ColorRGB &c)
+{
+    return Color(c.r, c.g, c.b);
+}
+
+// UTF-8文字列から1文字(コードポイント)を取り出す
+uint32_t next_codepoint(const char *&it)
+{
+    uint32_t cp = static_cast<unsigned char>(*it++);
+    if (cp < 0x80)
+        return cp;
+    int extra = (cp >= 0xF0) ? 3 : (cp >= 0xE0) ? 2 : 1;
+    cp &= (0x3F >> extra);
+    while (extra-- > 0 && *it)
+        cp = (cp << 6) | (static_cast<unsigned char>(*it++) & 0x3F);
+    return cp;
+}
+
+// --- フォント ---
+// BDF は数千字分のテキストを起動のたびに解析するので、compile_font.py で変換した形式も読めるようにする。
+// 変換した形式は mmap するだけで使え、グリフは描くときに OS が必要なページだけ読み込む。
+// make EMBED_FONT=1 では、表示に使う文字だけに絞った同じ形式をプログラムに埋め込み、ファイルは読まない
+const uint32_t REPLACEMENT_CODEPOINT = 0xFFFD;
+
+class DisplayFont
+{
+public:
+    virtual ~DisplayFont() = default;
+
+    virtual int height() const = 0;
+    virtual int baseline() const = 0;
+
+    // 送り幅 (フォントにない文字は -1)
+    virtual int CharacterWidth(uint32_t cp) const = 0;
+
+    // baseline を y に合わせて描き、送り幅を返す。フォントにない文字は U+FFFD で描く。
+    // bg があればグリフの枠内の消灯部分をその色で塗る
+    virtual int DrawGlyph(rgb_matrix::Canvas *canvas, int x, int y, const Color &color, const Color *bg,
+                          uint32_t cp) const = 0;
+
+    int DrawGlyph(rgb_matrix::Canvas *canvas, int x, int y, const Color &color, uint32_t cp) const
+    {
+        return DrawGlyph(canvas, x, y, color, nullptr, cp);
+    }
+};
+
+// BDF をライブラリの rgb_matrix::Font で読む
+class BdfFont : public DisplayFont
+{
+public:
+    bool load(const std::string &path) { return font_.LoadFont(path.c_str()); }
+
+    int height() const override { return font_.height(); }
+    int baseline() const override { return font_.baseline(); }
+    int CharacterWidth(uint32_t cp) const override { return font_.CharacterWidth(cp); }
+    int DrawGlyph(rgb_matrix::Canvas *canvas, int x, int y, const Color &color, const Color *bg,
+                  uint32_t cp) const override
+    {
+        return font_.DrawGlyph(canvas, x, y, color, bg, cp);
+    }
+
+private:
+    rgb_matrix::Font font_;
+};
+
+// compile_font.py の出力 (リトルエンディアン)。
+//   ヘッダ | 範囲 × range_count | グリフ × glyph_count | ビットマップ
+// 範囲はコードポイントの連続した区間で、first_cp の昇順に並ぶ。
+// ビットマップはグリフごとに device_width × height ビットを行の順に詰め、バイト境界から始まる
+const char PACKED_FONT_MAGIC[4] = {'P', 'B', 'F', '1'};
+
+struct PackedFontHeader
+{
+    char magic[4];
+    int16_t height;
+    int16_t baseline;
+    uint32_t range_count;
+    uint32_t glyph_count;
+    uint32_t bitmap_bytes;
+    uint32_t reserved;
+};
+
+struct PackedFontRange
+{
+    uint32_t first_cp;
+    uint32_t count;
+    uint32_t first_glyph;
+};
+
+struct PackedGlyph
+{
+    uint32_t offset; // ビットマップ内の位置 (バイト)
+    uint8_t device_width;
+    uint8_t height;
+    int8_t y_offset;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(PackedFontHeader) == 24 && sizeof(PackedFontRange) == 12 && sizeof(PackedGlyph) == 8,
+              "packed font layout");
+
+class PackedFont : public DisplayFont
+{
+public:
+    ~PackedFont()
+    {
+        if (mapped_ != nullptr)
+            munmap(mapped_, mapped_size_);
+    }
+
+    // ファイルを mmap して使う
+    bool load(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void *base = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(PackedFontHeader))
+            base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+            return false;
+        mapped_ = base;
+        mapped_size_ = st.st_size;
+        return attach(base, mapped_size_);
+    }
+
+    // メモリ上の data をそのまま使う (data は font より長く残すこと)
+    bool attach(const void *data, size_t size)
+    {
+        // 各部の大きさだけ確かめる (グリフごとの範囲は引くときに確かめ、ここでは全体を読まない)
+        if (size < sizeof(PackedFontHeader))
+            return false;
+        header_ = static_cast<const PackedFontHeader *>(data);
+        if (std::memcmp(header_->magic, PACKED_FONT_MAGIC, sizeof(PACKED_FONT_MAGIC)) != 0)
+            return false;
+        if (header_->height <= 0 || header_->baseline <= 0)
+            return false;
+        uint64_t ranges_end = sizeof(PackedFontHeader) + uint64_t(header_->range_count) * sizeof(PackedFontRange);
+        uint64_t glyphs_end = ranges_end + uint64_t(header_->glyph_count) * sizeof(PackedGlyph);
+        if (glyphs_end + header_->bitmap_bytes != size)
+            return false;
+        const char *p = static_cast<const char *>(data);
+        ranges_ = reinterpret_cast<const PackedFontRange *>(p + sizeof(PackedFontHeader));
+        glyphs_ = reinterpret_cast<const PackedGlyph *>(p + ranges_end);
+        bitmap_ = reinterpret_cast<const uint8_t *>(p + glyphs_end);
+        return true;
+    }
+
+    int height() const override { return header_->height; }
+    int baseline() const override { return header_->baseline; }
+
+    int CharacterWidth(uint32_t cp) const override
+    {
+        const PackedGlyph *g = find(cp);
+        return g ? g->device_width : -1;
+    }
+
+    int DrawGlyph(rgb_matrix::Canvas *canvas, int x, int y, const Color &color, const Color *bg,
+                  uint32_t cp) const override
+    {
+        const PackedGlyph *g = find(cp);
+        if (g == nullptr)
+            g = find(REPLACEMENT_CODEPOINT);
+        if (g == nullptr)
+            return 0;
+        int w = g->device_width;
+        int h = g->height;
+        y = y - h - g->y_offset;
+        if (x + w < 0 || x > canvas->width() || y + h < 0 || y > canvas->height())
+            return w;
+
+        const uint8_t *bits = bitmap_ + g->offset;
+        size_t bit = 0;
+        for (int row = 0; row < h; ++row)
+        {
+            for (int col = 0; col < w; ++col, ++bit)
+            {
+                if (bits[bit >> 3] & (0x80 >> (bit & 7)))
+                    canvas->SetPixel(x + col, y + row, color.r, color.g, color.b);
+                else if (bg != nullptr)
+                    canvas->SetPixel(x + col, y + row, bg->r, bg->g, bg->b);
+            }
+        }
+        return w;
+    }
+
+private:
+    const PackedGlyph *find(uint32_t cp) const
+    {
+        // cp を含みうる最後の範囲
+        const PackedFontRange *end = ranges_ + header_->range_count;
+        const PackedFontRange *r = std::upper_bound(ranges_, end, cp, [](uint32_t c, const PackedFontRange &range) {
+            return c < range.first_cp;
+        });
+        if (r == ranges_)
+            return nullptr;
+        --r;
+        if (cp - r->first_cp >= r->count)
+            return nullptr;
+        uint64_t index = uint64_t(r->first_glyph) + (cp - r->first_cp);
+        if (index >= header_->glyph_count)
+            return nullptr;
+        const PackedGlyph *g = &glyphs_[index];
+        if (uint64_t(g->offset) + (g->device_width * g->height + 7) / 8 > header_->bitmap_bytes)
+            return nullptr;
+        return g;
+    }
+
+    void *mapped_ = nullptr; // load() で mmap した領域
+    size_t mapped_size_ = 0;
+    const PackedFontHeader *header_ = nullptr;
+    const PackedFontRange *ranges_ = nullptr;
+    const PackedGlyph *glyphs_ = nullptr;
+    const uint8_t *bitmap_ = nullptr;
+};
+
+#ifndef EMBED_FONT
+// 先頭が PACKED_FONT_MAGIC なら変換した形式、それ以外は BDF として読む。読めなければ nullptr
+std::unique_ptr<DisplayFont> load_font_file(const std::string &path)
+{
+    char magic[sizeof(PACKED_FONT_MAGIC)] = {};
+    std::ifstream in(path, std::ios::binary);
+    if (!in.read(magic, sizeof(magic)))
+        return nullptr;
+    in.close();
+
+    if (std::memcmp(magic, PACKED_FONT_MAGIC, sizeof(magic)) == 0)
+    {
+        std::unique_ptr<PackedFont> font(new PackedFont);
+        if (!font->load(path))
+            return nullptr;
+        return font;
+    }
+    std::unique_ptr<BdfFont> font(new BdfFont);
+    if (!font->load(path))
+        return nullptr;
+    return font;
+}
+#endif
+
+// フォントを読む。読めなければ nullptr。
+// 変換した形式 (.pbf) がない・壊れているときは、同じ名前の .bdf を読む (make で .pbf を作っていない場合など)。
+// 埋め込んだフォントがあればそれを使い、path は読まない (fonts/ がなくても壊れていても表示できる)
+std::unique_ptr<DisplayFont> load_font(const std::string &path)
+{
+#ifdef EMBED_FONT
+    std::unique_ptr<PackedFont> embedded(new PackedFont);
+    if (!embedded->attach(EMBEDDED_FONT, sizeof(EMBEDDED_FONT)))
+        return nullptr;
+    return embedded;
+#else
+    std::unique_ptr<DisplayFont> font = load_font_file(path);
+    const std::string packed_ext = ".pbf";
+    if (font == nullptr && path.size() > packed_ext.size() &&
+        path.compare(path.size() - packed_ext.size(), packed_ext.size(), packed_ext) == 0)
+    {
+        std::string bdf = path.substr(0, path.size() - packed_ext.size()) + ".bdf";
+        fprintf(stderr, "Couldn't load font '%s', falling back to '%s'\n", path.c_str(), bdf.c_str());
+        font = load_font_file(bdf);
+    }
+    return font;
+#endif
+}
+
+// UTF-8 の文字列を描き、描いた幅を返す (rgb_matrix::DrawText と同じ)
+int draw_text(rgb_matrix::Canvas *canvas, const DisplayFont &font, int x, int y, const Color &color,
+              const char *utf8)
+{
+    int start = x;
+    while (*utf8)
+        x += font.DrawGlyph(canvas, x, y, color, next_codepoint(utf8));
+    return x - start;
+}
+
+// 1文字の送り幅。フォントにない文字は描くときと同じく U+FFFD の幅で進む
+int glyph_advance(const DisplayFont &font, uint32_t cp)
+{
+    int w = font.CharacterWidth(cp);
+    if (w < 0)
+        w = font.CharacterWidth(REPLACEMENT_CODEPOINT);
+    return std::max(0, w);
+}
+
+// 文字列の描画幅(px)をフォントから計算する
+int measure_text(const DisplayFont &font, const char *text)
+{
+    int width = 0;
+    const char *it = text;
+    while (*it)
+        width += glyph_advance(font, next_codepoint(it));
+    return width;
+}
+
+bool same_color(const ColorRGB &a, const ColorRGB &b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+// 文字の装飾
+enum SpanStyle : uint8_t
+{
+    STYLE_NONE = 0,
+    STYLE_BLINK = 1u << 0,    // 1秒ごとに点滅 (時計のコロンと同じ位相)
+    STYLE_EMPHASIS = 1u << 1, // 反転表示 (色の地に黒い文字)
+};
+
+// 文字列の一部の色・装飾を変える範囲 (文字単位)
+struct TextSpan
+{
+    int first = 0; // 最初の文字の位置
+    int count = 0; // 文字数
+    ColorRGB color;
+    uint8_t style = STYLE_NONE;
+};
+
+// SpanBuffer 中の範囲
+struct SpanRange
+{
+    uint32_t offset = 0;
+    uint32_t count = 0;
+};
+
+// 全メッセージの範囲を1本にまとめて持つバッファ。各メッセージは SpanRange で自分の分を指す
+struct SpanBuffer
+{
+    std::vector<TextSpan> spans;
+
+    SpanRange append(const TextSpan *first, const TextSpan *last)
+    {
+        SpanRange range{static_cast<uint32_t>(spans.size()), static_cast<uint32_t>(last - first)};
+        spans.insert(spans.end(), first, last);
+        return range;
+    }
+    SpanRange append(const std::vector<TextSpan> &v) { return append(v.data(), v.data() + v.size()); }
+
+    const TextSpan *begin(SpanRange r) const { return spans.data() + r.offset; }
+    const TextSpan *end(SpanRange r) const { return spans.data() + r.offset + r.count; }
+};
+
+// 文字ごとの左端位置を持った文字列。スクロール中に見えている文字だけを描くのに使う
+struct GlyphRun
+{
+    std::vector<uint32_t> codepoints;
+    std::vector<int> offsets; // offsets[i]: i文字目の左端 (末尾に全体の幅)
+    SpanRange spans;          // 基本色と違う色・装飾で描く範囲 (位置順、重なりなし)
+
+    void build(const DisplayFont &font, const std::string &text)
+    {
+        codepoints.clear();
+        offsets.assign(1, 0);
+        const char *it = text.c_str();
+        while (*it)
+        {
+            uint32_t cp = next_codepoint(it);
+            codepoints.push_back(cp);
+            offsets.push_back(offsets.back() + glyph_advance(font, cp));
+        }
+    }
+
+    int width() const { return offsets.empty() ? 0 : offsets.back(); }
+};
+
+// x に置いた文字列のうち、横方向 [clip_left, clip_right) にかかる文字だけを描く。
+// 最初の文字は累積幅の二分探索で求め、右端を越えたら打ち切るので、
+// 手間は文字列の長さではなく表示幅で決まる。blink_on が false なら点滅の文字は描かない。
+// 色・装飾の範囲は spans の run.spans の位置にある
+void draw_run_clipped(rgb_matrix::Canvas *canvas, const DisplayFont &font, const GlyphRun &run,
+                      const SpanBuffer &spans, int x, int baseline, const Color &color, int clip_left, int clip_right,
+                      bool blink_on = true)
+{
+    if (run.codepoints.empty())
+        return;
+
+    // 右端が clip_left より右にある最初の文字
+    auto right_edges = run.offsets.begin() + 1;
+    size_t first = std::upper_bound(right_edges, run.offsets.end(), clip_left - x) - right_edges;
+    const TextSpan *span = spans.begin(run.spans);
+    const TextSpan *spans_end = spans.end(run.spans);
+    for (size_t i = first; i < run.codepoints.size(); ++i)
+    {
+        int glyph_x = x + run.offsets[i];
+        if (glyph_x >= clip_right)
+            break;
+
+        int index = static_cast<int>(i);
+        while (span != spans_end && span->first + span->count <= index)
+            ++span;
+        if (span == spans_end || span->first > index)
+        {
+            font.DrawGlyph(canvas, glyph_x, baseline, color, run.codepoints[i]);
+            continue;
+        }
+
+        if ((span->style & STYLE_BLINK) && !blink_on)
+            continue;
+        Color span_color = ToMatrixColor(span->color);
+        if (span->style & STYLE_EMPHASIS)
+        {
+            Color black(0, 0, 0);
+            font.DrawGlyph(canvas, glyph_x, baseline, black, &span_color, run.codepoints[i]);
+        }
+        else
+        {
+            font.DrawGlyph(canvas, glyph_x, baseline, span_color, run.codepoints[i]);
+        }
+    }
+}
+
+// 文字ごとの色・装飾を範囲にまとめ直す (has[i] が false の文字は基本色のまま)
+std::vector<TextSpan> compress_spans(const std::vector<bool> &has, const std::vector<ColorRGB> &colors,
+                                     const std::vector<uint8_t> &styles)
+{
+    std::vector<TextSpan> spans;
+    for (size_t i = 0; i < has.size(); ++i)
+    {
+        if (!has[i])
+            continue;
+        int index = static_cast<int>(i);
+        if (!spans.empty() && spans.back().first + spans.back().count == index &&
+            same_color(spans.back().color, colors[i]) && spans.back().style == styles[i])
+            spans.back().count++;
+        else
+            spans.push_back({index, 1, colors[i], styles[i]});
+    }
+    return spans;
+}
+
+// 基本の装飾に強調表示を重ねる。上書きするのは地の文 (基本色か白) の色だけで、
+// 路線カラーのように色を指定された部分と、点滅などの装飾はそのまま残す
+std::vector<TextSpan> overlay_spans(const TextSpan *base, const TextSpan *base_end,
+                                    const std::vector<TextSpan> &overlay, ColorRGB base_color, int glyphs)
+{
+    if (overlay.empty())
+        return std::vector<TextSpan>(base, base_end);
+
+    std::vector<bool> has(glyphs, false);
+    std::vector<ColorRGB> colors(glyphs, base_color);
+    std::vector<uint8_t> styles(glyphs, STYLE_NONE);
+    for (const TextSpan *span = base; span != base_end; ++span)
+    {
+        for (int i = span->first; i < span->first + span->count && i < glyphs; ++i)
+        {
+            has[i] = true;
+            colors[i] = span->color;
+            styles[i] = span->style;
+        }
+    }
+    for (const TextSpan &span : overlay)
+    {
+        for (int i = span.first; i < span.first + span.count && i < glyphs; ++i)
+        {
+            if (!same_color(colors[i], base_color) && !same_color(colors[i], COL_WHITE))
+                continue;
+            has[i] = true;
+            colors[i] = span.color;
+        }
+    }
+    return compress_spans(has, colors, styles);
+}
+
+
+// 色名 ("red" など) または "#RRGGBB" を色にする
+bool parse_color(const std::string &name, ColorRGB &out)
+{
+    unsigned r, g, b;
+    if (name.size() == 7 && name[0] == '#' && sscanf(name.c_str() + 1, "%2x%2x%2x", &r, &g, &b) == 3)
+    {
+        out = ColorRGB{static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b)};
+        return true;
+    }
+
+    static const std::pair<const char *, ColorRGB> names[] = {
+        {"white", COL_WHITE}, {"red", COL_RED}, {"green", COL_GREEN}, {"blue", COL_BLUE},
+        {"magenta", COL_MAGENTA}, {"orange", COL_ORANGE}, {"yellow", COL_YELLOW}, {"cyan", COL_CYAN}};
+    for (auto const &[n, c] : names)
+    {
+        if (name == n)
+        {
+            out = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 複数キーワードの一括照合 (Aho–Corasick)。
+// 全キーワードを1本のオートマトンにまとめ、文字列を1回なめるだけで全件を見つける
+class KeywordMatcher
+{
+public:
+    void build(const std::vector<std::string> &keywords)
+    {
+        lengths_.clear();
+        nodes_.assign(1, Node());
+        for (const std::string &word : keywords)
+        {
+            int index = static_cast<int>(lengths_.size());
+            lengths_.push_back(word.size());
+            if (word.empty())
+                continue;
+            int state = 0;
+            for (unsigned char c : word)
+            {
+                auto it = nodes_[state].next.find(c);
+                if (it == nodes_[state].next.end())
+                {
+                    nodes_.push_back(Node());
+                    it = nodes_[state].next.emplace(c, static_cast<int>(nodes_.size() - 1)).first;
+                }
+                state = it->second;
+            }
+            nodes_[state].out = index;
+        }
+
+        // 幅優先で失敗リンクを張る
+        std::vector<int> queue;
+        for (auto const &[c, child] : nodes_[0].next)
+            queue.push_back(child);
+        for (size_t head = 0; head < queue.size(); ++head)
+        {
+            int u = queue[head];
+            for (auto const &[c, v] : nodes_[u].next)
+            {
+                int f = nodes_[u].fail;
+                while (f > 0 && !nodes_[f].next.count(c))
+                    f = nodes_[f].fail;
+                auto it = nodes_[f].next.find(c);
+                nodes_[v].fail = (it != nodes_[f].next.end() && it->second != v) ? it->second : 0;
+                int fv = nodes_[v].fail;
+                nodes_[v].dict = nodes_[fv].out >= 0 ? fv : nodes_[fv].dict;
+                queue.push_back(v);
+            }
+        }
+    }
+
+    bool empty() const { return nodes_.size() <= 1; }
+
+    // 見つかったキーワードごとに on_match(開始バイト, 終了バイト, キーワードの番号) を呼ぶ
+    template <typename F>
+    void for_each_match(const std::string &text, F on_match) const
+    {
+        if (empty())
+            return;
+        int state = 0;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            while (state > 0 && !nodes_[state].next.count(c))
+                state = nodes_[state].fail;
+            auto it = nodes_[state].next.find(c);
+            state = (it != nodes_[state].next.end()) ? it->second : 0;
+
+            for (int n = nodes_[state].out >= 0 ? state : nodes_[state].dict; n > 0; n = nodes_[n].dict)
+            {
+                int keyword = nodes_[n].out;
+                on_match(i + 1 - lengths_[keyword], i + 1, keyword);
+            }
+        }
+    }
+
+private:
+    struct Node
+    {
+        std::map<unsigned char, int> next;
+        int fail = 0;
+        int out = -1;  // ここで終わるキーワード
+        int dict = -1; // 失敗リンクをたどって最初にキーワードが終わる節点
+    };
+    std::vector<Node> nodes_ = std::vector<Node>(1);
+    std::vector<size_t> lengths_;
+};
+
+// メッセージ中のキーワードを色付けする。
+// オートマトンを作るのは設定の読み込み時 (と路線名が変わったとき)、照合はメッセージが追加されたときだけ
+class KeywordHighlighter
+{
+public:
+    void build(const std::vector<std::pair<std::string, ColorRGB>> &keywords)
+    {
+        std::vector<std::string> words;
+        colors_.clear();
+        for (auto const &[word, color] : keywords)
+        {
+            words.push_back(word);
+            colors_.push_back(color);
+        }
+        matcher_.build(words);
+    }
+
+    bool empty() const { return matcher_.empty(); }
+
+    // text 中のキーワードの範囲を文字単位で返す。重なったら長いキーワードを優先
+    std::vector<TextSpan> spans(const std::string &text) const
+    {
+        std::vector<TextSpan> result;
+        struct Match
+        {
+            size_t begin, end;
+            int keyword;
+        };
+        std::vector<Match> matches;
+        matcher_.for_each_match(text, [&](size_t begin, size_t end, int keyword) {
+            matches.push_back({begin, end, keyword});
+        });
+        if (matches.empty())
+            return result;
+
+        // バイトごとの色 (-1: 基本色)。長いキーワードから塗り、重なった部分は先に塗った方を残す
+        std::stable_sort(matches.begin(), matches.end(), [](const Match &a, const Match &b) {
+            return a.end - a.begin > b.end - b.begin;
+        });
+        std::vector<int> byte_keyword(text.size(), -1);
+        for (const Match &m : matches)
+        {
+            for (size_t i = m.begin; i < m.end; ++i)
+            {
+                if (byte_keyword[i] < 0)
+                    byte_keyword[i] = m.keyword;
+            }
+        }
+
+        // 文字単位の範囲にまとめる (文字の色は先頭バイトで決める)
+        int glyph = 0;
+        const char *it = text.c_str();
+        while (*it)
+        {
+            int keyword = byte_keyword[it - text.c_str()];
+            next_codepoint(it);
+            if (keyword >= 0)
+            {
+                const ColorRGB &color = colors_[keyword];
+                if (!result.empty() && result.back().first + result.back().count == glyph &&
+                    same_color(result.back().color, color))
+                    result.back().count++;
+                else
+                    result.push_back({glyph, 1, color});
+            }
+            glyph++;
+        }
+        return result;
+    }
+
+private:
+    KeywordMatcher matcher_;
+    std::vector<ColorRGB> colors_;
+};
+KeywordHighlighter highlighter;
+
+// 運行情報の路線と自分の経路との関係
+enum Relevance
+{
+    REL_ELSEWHERE = 0, // 関係なし
+    REL_NEARBY = 1,    // watch_lines の路線
+    REL_ON_ROUTE = 2,  // 発車情報の経路に含まれる路線
+};
+
+// 運行情報の路線名を経路・監視対象の路線名と照合する。路線名は経路か設定が変わったときだけ登録し直す
+class RelevanceIndex
+{
+public:
+    void build(const std::vector<std::string> &route_lines, const std::vector<std::string> &watch_lines)
+    {
+        std::vector<std::string> words(route_lines);
+        words.insert(words.end(), watch_lines.begin(), watch_lines.end());
+        route_count_ = static_cast<int>(route_lines.size());
+        matcher_.build(words);
+    }
+
+    // 路線の表示名 ("ＪＲ南武線" など) に経路の路線名が含まれていれば経路上
+    Relevance classify(const std::string &name) const
+    {
+        if (matcher_.empty())
+            return REL_ON_ROUTE; // 絞り込む手がかりがなければすべて経路上として扱う
+        Relevance rel = REL_ELSEWHERE;
+        matcher_.for_each_match(name, [&](size_t, size_t, int keyword) {
+            rel = std::max(rel, keyword < route_count_ ? REL_ON_ROUTE : REL_NEARBY);
+        });
+        return rel;
+    }
+
+private:
+    KeywordMatcher matcher_;
+    int route_count_ = 0;
+};
+
+// 設定のキーワードと路線名から強調表示を作り直す
+void build_highlighter(const std::vector<std::string> &route_lines)
+{
+    std::vector<std::pair<std::string, ColorRGB>> keywords;
+    for (auto const &[word, color_name] : config.highlight_words)
+    {
+        ColorRGB color;
+        if (parse_color(color_name, color))
+            keywords.emplace_back(word, color);
+        else
+            fprintf(stderr, "Unknown highlight color '%s' for '%s'\n", color_name.c_str(), word.c_str());
+    }
+
+    ColorRGB line_color;
+    if (parse_color(config.highlight_route_lines, line_color))
+    {
+        for (const std::string &line : route_lines)
+            keywords.emplace_back(line, line_color);
+    }
+    highlighter.build(keywords);
+}
+
+// 単語境界とみなす文字 (割り込み表示の切れ目に使う)
+bool is_break_codepoint(uint32_t cp)
+{
+    switch (cp)
+    {
+    case ' ':
+    case ':':
+    case 0x3000: // 全角スペース
+    case 0x3001: // 、
+    case 0x3002: // 。
+    case 0x3011: // 】
+    case 0xFF09: // ）
+    case 0xFF1A: // ：
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 単語境界の直後の位置(px)を列挙する
+std::vector<int> measure_breaks(const DisplayFont &font, const std::string &text)
+{
+    std::vector<int> breaks;
+    int x = 0;
+    const char *it = text.c_str();
+    while (*it)
+    {
+        uint32_t cp = next_codepoint(it);
+        x += glyph_advance(font, cp);
+        if (is_break_codepoint(cp))
+            breaks.push_back(x);
+    }
+    return breaks;
+}
+
+// 営業時間 (始発〜終電)。3時を日付の境目とした分で保持する
+struct ServiceHours
+{
+    bool valid = false;
+    int first_minutes = 0; // 最も早い始発
+    int last_minutes = 0;  // 最も遅い終電
+};
+
+// --- スクロールメッセージ ---
+// 優先度。URGENT のメッセージが新たに届くと表示中のメッセージに割り込む
+enum TickerPriority
+{
+    PRIO_INFO = 0,   // 日付・天気など
+    PRIO_NOTICE = 1, // 遅延・エラー
+    PRIO_URGENT = 2, // 運転見合わせ
+};
+
+// メッセージの識別子 (内容のハッシュ)。種類・路線名・詳細が同じなら同じ値になる
+uint64_t message_id(std::initializer_list<std::string_view> parts)
+{
+    // FNV-1a 64bit。区切りに 0xFF を入れて ("ab","c") と ("a","bc") を区別する
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (std::string_view part : parts)
+    {
+        for (unsigned char c : part)
+        {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+        h ^= 0xFF;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+struct TickerMessage
+{
+    uint64_t id = 0; // message_id() の値
+    std::string text;
+    ColorRGB color;  // 基本色
+    SpanRange spans; // 基本色と違う色・装飾の範囲 (TickerScheduler::spans 中。文字単位、位置順)
+    int priority = PRIO_INFO;
+    int weight = 1;             // 表示頻度の重み (2なら1の2倍の頻度)
+    int ttl_seconds = 0;        // 最初に届いてからの表示期限 (0: 無期限)
+    int min_repeat_seconds = 0; // 再表示までの最短間隔
+
+    // 描画用 (追加時に一度だけ計算し、内容が変わらない限り使い回す)
+    GlyphRun run;            // 文字ごとの位置
+    int width = 0;           // 描画幅(px)
+    std::vector<int> breaks; // 単語境界の位置(px)
+
+    // スケジューラの状態
+    double pass = 0; // ストライドスケジューリングの仮想時刻 (小さいものから表示)
+    bool shown = false;
+    std::chrono::steady_clock::time_point added;
+    std::chrono::steady_clock::time_point last_shown;
+
+    // 差分更新用
+    int order = 0;        // 入力データ中の順番
+    bool seen = false;    // 今回の読み込みで存在を確認したか
+    bool removed = false; // 入力から消えたが表示中のため残している
+};
+
+TickerMessage make_message(const std::string &text, ColorRGB color, int priority, int weight,
+                           int min_repeat_seconds = 0, int ttl_seconds = 0)
+{
+    TickerMessage msg;
+    msg.text = text;
+    msg.color = color;
+    msg.priority = priority;
+    msg.weight = weight;
+    msg.min_repeat_seconds = min_repeat_seconds;
+    msg.ttl_seconds = ttl_seconds;
+    return msg;
+}
+
+// メッセージの一部分 (色と装飾をそろえて描く文字列)
+struct TextPart
+{
+    std::string text;
+    ColorRGB color;
+    uint8_t style = STYLE_NONE;
+};
+
+// 部分をつないで1つのメッセージにする。文字列は1本にまとめ、部分ごとの色・装飾は範囲として spans に足す
+TickerMessage make_message(SpanBuffer &spans, const std::vector<TextPart> &parts, ColorRGB color, int priority,
+                           int weight, int min_repeat_seconds = 0, int ttl_seconds = 0)
+{
+    TickerMessage msg = make_message("", color, priority, weight, min_repeat_seconds, ttl_seconds);
+    msg.spans.offset = static_cast<uint32_t>(spans.spans.size());
+    int glyph = 0;
+    for (const TextPart &part : parts)
+    {
+        int count = 0;
+        const char *it = part.text.c_str();
+        while (*it)
+        {
+            next_codepoint(it);
+            count++;
+        }
+        if (count > 0 && (!same_color(part.color, color) || part.style != STYLE_NONE))
+            spans.spans.push_back({glyph, count, part.color, part.style});
+        msg.text += part.text;
+        glyph += count;
+    }
+    msg.spans.count = static_cast<uint32_t>(spans.spans.size()) - msg.spans.offset;
+    return msg;
+}
+
+// 取得側が作った装飾付きメッセージ ([{"text", "color", "style"}, ...]) を読む。
+// 色を省略した部分は基本色、style は "blink" / "emphasis"
+bool parts_from_json(const input_json &spans, ColorRGB color, std::vector<TextPart> &parts)
+{
+    parts.clear();
+    if (!spans.is_array())
+        return false;
+    for (const auto &span : spans)
+    {
+        if (!span.is_object() || !span.contains("text") || !span["text"].is_string())
+            continue;
+        TextPart part{span["text"].get<std::string>(), color};
+        if (span.contains("color") && span["color"].is_string())
+            parse_color(span["color"].get<std::string>(), part.color);
+        std::string style(span.value("style", ""));
+        if (style == "blink")
+            part.style = STYLE_BLINK;
+        else if (style == "emphasis")
+            part.style = STYLE_EMPHASIS;
+        parts.push_back(std::move(part));
+    }
+    return !parts.empty();
+}
+
+// 読み込み1回分の差分
+struct TickerDiff
+{
+    int added = 0;
+    int removed = 0;
+    int unchanged = 0;
+};
+
+const int PREEMPT_MAX_MS = 1000; // 単語境界が来なくても割り込むまでの上限
+
+// 表示順を決めるスケジューラ
+// 重みに比例した頻度で表示し、再表示間隔とTTLを守る。
+// 緊急メッセージが届いたら、表示中のメッセージを次の単語境界で打ち切る。
+//
+// 読み込みごとの更新は差分で行う:
+//   begin_sync() → 各メッセージについて touch(id) が false なら add() → end_sync()
+// 内容が変わらないメッセージは描画幅などのキャッシュとスケジュール状態を保ったまま残り、
+// 表示中のメッセージは入力から消えてもスクロールし終わるまで残す。
+struct TickerScheduler
+{
+    std::vector<TickerMessage> messages;
+    SpanBuffer spans; // 全メッセージの色・装飾の範囲
+    int current = -1; // 表示中のメッセージ (-1: なし)
+
+    bool preempt_pending = false;
+    int preempt_exposed = -1; // 割り込み要求後、最初に確認した時点の表示済み幅
+    std::chrono::steady_clock::time_point preempt_requested;
+
+    // 同期中の状態
+    int sync_order = 0;
+    double sync_base_pass = 0;
+    bool sync_initial = false;
+    TickerDiff diff;
+
+    bool expired(const TickerMessage &msg, std::chrono::steady_clock::time_point now) const
+    {
+        return msg.ttl_seconds > 0 && now - msg.added >= std::chrono::seconds(msg.ttl_seconds);
+    }
+
+    void begin_sync()
+    {
+        for (auto &msg : messages)
+            msg.seen = false;
+        sync_order = 0;
+        sync_initial = messages.empty();
+        diff = TickerDiff();
+
+        // 新しいメッセージは現在最も進んでいないメッセージと同じ位置から始める
+        sync_base_pass = 0;
+        for (size_t i = 0; i < messages.size(); ++i)
+            sync_base_pass = (i == 0) ? messages[i].pass : std::min(sync_base_pass, messages[i].pass);
+    }
+
+    // 既存のメッセージなら存在を記録して true を返す
+    bool touch(uint64_t id)
+    {
+        for (auto &msg : messages)
+        {
+            if (msg.id == id)
+            {
+                msg.order = sync_order;
+                msg.seen = true;
+                msg.removed = false;
+                sync_order++;
+                diff.unchanged++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 新しいメッセージを追加する (描画幅などはここで一度だけ計算)
+    void add(uint64_t id, TickerMessage msg, const DisplayFont &font,
+             std::chrono::steady_clock::time_point now)
+    {
+        msg.id = id;
+        msg.order = sync_order++;
+        msg.seen = true;
+        msg.run.build(font, msg.text);
+        msg.run.spans = spans.append(overlay_spans(spans.begin(msg.spans), spans.end(msg.spans),
+                                                   highlighter.spans(msg.text), msg.color,
+                                                   static_cast<int>(msg.run.codepoints.size())));
+        msg.width = msg.run.width();
+        msg.breaks = measure_breaks(font, msg.text);
+        msg.added = now;
+        msg.pass = sync_base_pass;
+        if (!sync_initial && msg.priority >= PRIO_URGENT)
+        {
+            // 次に必ず選ばれるようにして割り込みを要求する
+            msg.pass = sync_base_pass - 1.0;
+            preempt_pending = true;
+            preempt_exposed = -1;
+            preempt_requested = now;
+        }
+        messages.push_back(std::move(msg));
+        diff.added++;
+    }
+
+    // 消えたメッセージを取り除き、入力の順に並べ直す
+    TickerDiff end_sync()
+    {
+        if (diff.added == 0 && diff.unchanged == static_cast<int>(messages.size()))
+            return diff; // 変化なし
+
+        uint64_t current_id = current >= 0 ? messages[current].id : 0;
+        std::vector<TickerMessage> kept;
+        kept.reserve(messages.size());
+        for (auto &msg : messages)
+        {
+            if (!msg.seen)
+            {
+                if (current >= 0 && msg.id == current_id)
+                {
+                    // 表示中はスクロールし終わるまで残す
+                    if (!msg.removed)
+                        diff.removed++;
+                    msg.removed = true;
+                    msg.order = sync_order + 1;
+                }
+                else
+                {
+                    diff.removed++;
+                    continue;
+                }
+            }
+            kept.push_back(std::move(msg));
+        }
+        std::stable_sort(kept.begin(), kept.end(),
+                         [](const TickerMessage &a, const TickerMessage &b) { return a.order < b.order; });
+        messages = std::move(kept);
+        compact_spans();
+
+        current = -1;
+        for (size_t i = 0; i < messages.size(); ++i)
+        {
+            if (current_id != 0 && messages[i].id == current_id)
+                current = static_cast<int>(i);
+        }
+        return diff;
+    }
+
+    // 次に表示するメッセージを選ぶ
+    int pick(std::chrono::steady_clock::time_point now) const
+    {
+        int best = -1;
+        bool best_ready = false;
+        for (size_t i = 0; i < messages.size(); ++i)
+        {
+            const TickerMessage &msg = messages[i];
+            if (msg.removed || expired(msg, now))
+                continue;
+
+            bool ready = !msg.shown || now - msg.last_shown >= std::chrono::seconds(msg.min_repeat_seconds);
+            if (best >= 0)
+            {
+                const TickerMessage &b = messages[best];
+                if (best_ready && !ready)
+                    continue;
+                if (best_ready == ready)
+                {
+                    if (msg.pass > b.pass)
+                        continue;
+                    if (msg.pass == b.pass && msg.priority <= b.priority)
+                        continue;
+                }
+            }
+            best = static_cast<int>(i);
+            best_ready = ready;
+        }
+        return best;
+    }
+
+    // 表示中のメッセージを返す。なければ次を選んで表示を開始する
+    TickerMessage *current_message(std::chrono::steady_clock::time_point now, bool &started)
+    {
+        started = false;
+        if (current < 0)
+        {
+            current = pick(now);
+            if (current < 0)
+                return nullptr;
+
+            TickerMessage &msg = messages[current];
+            msg.pass += 1.0 / std::max(1, msg.weight);
+            msg.shown = true;
+            msg.last_shown = now;
+            started = true;
+        }
+        return &messages[current];
+    }
+
+    // キーワードが変わったときに強調表示を付け直す
+    void rehighlight()
+    {
+        SpanBuffer rebuilt;
+        for (auto &msg : messages)
+        {
+            msg.run.spans = rebuilt.append(overlay_spans(spans.begin(msg.spans), spans.end(msg.spans),
+                                                         highlighter.spans(msg.text), msg.color,
+                                                         static_cast<int>(msg.run.codepoints.size())));
+            msg.spans = rebuilt.append(spans.begin(msg.spans), spans.end(msg.spans));
+        }
+        spans = std::move(rebuilt);
+    }
+
+    // 消えたメッセージの範囲を詰める
+    void compact_spans()
+    {
+        SpanBuffer kept;
+        for (auto &msg : messages)
+        {
+            msg.spans = kept.append(spans.begin(msg.spans), spans.end(msg.spans));
+            msg.run.spans = kept.append(spans.begin(msg.run.spans), spans.end(msg.run.spans));
+        }
+        spans = std::move(kept);
+    }
+
+    // 表示中のメッセージを終了する (スクロールアウト・割り込み)
+    void finish_current()
+    {
+        if (current >= 0 && messages[current].removed)
+            messages.erase(messages.begin() + current);
+        current = -1;
+    }
+
+    // 割り込みで表示中のメッセージを打ち切るべきか
+    // exposed: 表示中のメッセージのうち、画面に入った幅(px)
+    bool should_preempt(int exposed, std::chrono::steady_clock::time_point now)
+    {
+        if (!preempt_pending)
+            return false;
+        if (current < 0 || messages[current].priority >= PRIO_URGENT)
+        {
+            // 次の選択で緊急メッセージが選ばれる / 緊急メッセージ同士は打ち切らない
+            preempt_pending = false;
+            return false;
+        }
+        if (preempt_exposed < 0)
+            preempt_exposed = exposed;
+
+        const TickerMessage &msg = messages[current];
+        bool at_break = exposed >= msg.width;
+        for (int b : msg.breaks)
+        {
+            if (b > preempt_exposed && b <= exposed)
+                at_break = true;
+        }
+        if (at_break || now - preempt_requested >= std::chrono::milliseconds(PREEMPT_MAX_MS))
+        {
+            preempt_pending = false;
+            return true;
+        }
+        return false;
+    }
+};
+
+// --- 設定ファイル ---
+// 設定ファイルを読み込み out を上書きする。書かれていない項目は out の値のまま。
+// 読み込めなかった場合は out を変更せず false を返す
+bool load_config(const std::string &path, Config &out)
+{
+    std::ifstream i(path);
+    if (!i.is_open())
+        return false;
+
+    Config c = out;
+    try
+    {
+        json j = json::parse(i);
+        if (j.contains("matrix"))
+        {
+            const json &m = j["matrix"];
+            c.matrix.hardware_mapping = m.value("hardware_mapping", c.matrix.hardware_mapping);
+            c.matrix.rows = m.value("rows", c.matrix.rows);
+            c.matrix.cols = m.value("cols", c.matrix.cols);
+            c.matrix.chain_length = m.value("chain_length", c.matrix.chain_length);
+            c.matrix.parallel = m.value("parallel", c.matrix.parallel);
+            c.matrix.pwm_bits = m.value("pwm_bits", c.matrix.pwm_bits);
+            c.matrix.pwm_lsb_nanoseconds = m.value("pwm_lsb_nanoseconds", c.matrix.pwm_lsb_nanoseconds);
+            c.matrix.brightness = m.value("brightness", c.matrix.brightness);
+            c.matrix.limit_refresh_rate_hz = m.value("limit_refresh_rate_hz", c.matrix.limit_refresh_rate_hz);
+            c.matrix.gpio_slowdown = m.value("gpio_slowdown", c.matrix.gpio_slowdown);
+            c.matrix.drop_privileges = m.value("drop_privileges", c.matrix.drop_privileges);
+        }
+        if (j.contains("files"))
+        {
+            const json &f = j["files"];
+            c.font_file = f.value("font", c.font_file);
+            c.departure_file = f.value("departure", c.departure_file);
+            c.operation_file = f.value("operation", c.operation_file);
+            c.weather_file = f.value("weather", c.weather_file);
+            c.first_last_file = f.value("first_last_train", c.first_last_file);
+        }
+        if (j.contains("timing"))
+        {
+            const json &t = j["timing"];
+            c.toggle_seconds = t.value("toggle_seconds", c.toggle_seconds);
+            c.reload_seconds = t.value("reload_seconds", c.reload_seconds);
+            c.scroll_frame_ms = t.value("scroll_frame_ms", c.scroll_frame_ms);
+            c.page_seconds = t.value("page_seconds", c.page_seconds);
+            c.marquee_step_ms = std::max(1, t.value("marquee_step_ms", c.marquee_step_ms));
+        }
+        if (j.contains("departure"))
+        {
+            const json &d = j["departure"];
+            c.red_minutes = d.value("red_minutes", c.red_minutes);
+            c.yellow_minutes = d.value("yellow_minutes", c.yellow_minutes);
+            c.pinned_rows.clear();
+            if (d.contains("pinned") && d["pinned"].is_object())
+            {
+                for (auto &el : d["pinned"].items())
+                {
+                    if (el.value().is_number_integer() && el.value().get<int>() >= 0)
+                        c.pinned_rows[el.key()] = el.value().get<int>();
+                }
+            }
+        }
+        if (j.contains("layout"))
+        {
+            const json &l = j["layout"];
+            c.line_height = l.value("line_height", c.line_height);
+        }
+        if (j.contains("ticker"))
+        {
+            const json &t = j["ticker"];
+            c.ticker_ribbon = t.value("ribbon", c.ticker_ribbon);
+            c.ticker_separator = t.value("separator", c.ticker_separator);
+            if (t.contains("highlights") && t["highlights"].is_array())
+            {
+                c.highlight_words.clear();
+                for (const auto &rule : t["highlights"])
+                {
+                    std::string color = rule.value("color", "white");
+                    if (rule.contains("words") && rule["words"].is_array())
+                    {
+                        for (const auto &word : rule["words"])
+                        {
+                            if (word.is_string())
+                                c.highlight_words.emplace_back(word.get<std::string>(), color);
+                        }
+                    }
+                }
+            }
+            c.highlight_route_lines = t.value("highlight_route_lines", c.highlight_route_lines);
+        }
+        if (j.contains("operation"))
+        {
+            const json &o = j["operation"];
+            if (o.contains("watch_lines") && o["watch_lines"].is_array())
+            {
+                c.watch_lines.clear();
+                for (const auto &line : o["watch_lines"])
+                {
+                    if (line.is_string() && !line.get<std::string>().empty())
+                        c.watch_lines.push_back(line.get<std::string>());
+                }
+            }
+            c.show_elsewhere = o.value("show_elsewhere", c.show_elsewhere);
+        }
+        if (j.contains("night"))
+        {
+            const json &n = j["night"];
+            c.night_enabled = n.value("enabled", c.night_enabled);
+            c.last_train_grace_minutes = n.value("last_train_grace_minutes", c.last_train_grace_minutes);
+            c.wake_before_first_minutes = n.value("wake_before_first_minutes", c.wake_before_first_minutes);
+            c.night_blank = n.value("blank", c.night_blank);
+            c.night_reload_seconds = n.value("reload_seconds", c.night_reload_seconds);
+        }
+        if (j.contains("threads"))
+        {
+            const json &t = j["threads"];
+            c.render_cpu = t.value("render_cpu", c.render_cpu);
+            c.loader_cpu = t.value("loader_cpu", c.loader_cpu);
+            c.render_priority = t.value("render_priority", c.render_priority);
+        }
+        if (j.contains("control"))
+        {
+            const json &ctl = j["control"];
+            c.control_socket = ctl.value("socket", c.control_socket);
+            c.heartbeat = ctl.value("heartbeat", c.heartbeat);
+        }
+        if (j.contains("trace"))
+        {
+            const json &tr = j["trace"];
+            c.trace_enabled = tr.value("enabled", c.trace_enabled);
+            c.trace_frame_budget_ms = tr.value("frame_budget_ms", c.trace_frame_budget_ms);
+            c.trace_dir = tr.value("dir", c.trace_dir);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "Couldn't parse config '%s': %s\n", path.c_str(), e.what());
+        return false;
+    }
+
+    // 0 以下だとループが回り続けるため下限を設ける
+    c.toggle_seconds = std::max(1, c.toggle_seconds);
+    c.reload_seconds = std::max(1, c.reload_seconds);
+    c.scroll_frame_ms = std::max(1, c.scroll_frame_ms);
+    c.page_seconds = std::max(1, c.page_seconds);
+    c.night_reload_seconds = std::max(1, c.night_reload_seconds);
+    // 99 はパネル更新スレッドが使うため、それより下に抑える
+    c.render_priority = std::clamp(c.render_priority, 0, MAX_RENDER_PRIORITY);
+
+    out = c;
+    return true;
+}
+
+// --- スレッド配置 ---
+// 描画はメインスレッド、入力ファイルの読み込み・解析は InputLoader のスレッドで行う。
+// rpi-rgb-led-matrix は4コア機でパネル更新スレッドを最後のコアに固定するため、どちらもそこを避ける
+const int MATRIX_REFRESH_CPU = 3;
+
+// スレッドを cpu に固定する。cpu < 0 ならパネル更新用のコア以外のどこでも動かす
+void pin_thread(pthread_t thread, int cpu, const char *name)
+{
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    bool refresh_pinned = cores == 4; // ライブラリが更新スレッドを固定する構成
+    if (cpu >= cores)
+    {
+        fprintf(stderr, "%s thread: CPU %d not available (%d cores), not pinning\n", name, cpu, cores);
+        cpu = -1;
+    }
+    else if (refresh_pinned && cpu == MATRIX_REFRESH_CPU)
+    {
+        fprintf(stderr, "%s thread: CPU %d is used by the matrix refresh thread\n", name, cpu);
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0)
+    {
+        CPU_SET(cpu, &set);
+    }
+    else
+    {
+        for (int i = 0; i < cores; ++i)
+        {
+            if (!(refresh_pinned && i == MATRIX_REFRESH_CPU))
+                CPU_SET(i, &set);
+        }
+    }
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0)
+        fprintf(stderr, "%s thread: couldn't set CPU affinity: %s\n", name, strerror(err));
+}
+
+// priority > 0 なら SCHED_FIFO、0 なら通常のスケジューリングにする。
+// 上げるには権限が要るため、描画スレッドは Matrix を作る (権限を手放す) 前に設定する
+void set_thread_priority(pthread_t thread, int priority, const char *name)
+{
+    sched_param param{};
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(thread, priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+    if (err != 0)
+        fprintf(stderr, "%s thread: couldn't set priority %d: %s\n", name, priority, strerror(err));
+}
+
+// 設定から Matrix を作成する
+RGBMatrix *create_matrix(const MatrixConfig &mc)
+{
+    // Options は文字列をポインタで持つため、Matrix の寿命の間は保持しておく
+    static std::string hardware_mapping;
+    hardware_mapping = mc.hardware_mapping;
+
+    RGBMatrix::Options defaults;
+    defaults.hardware_mapping = hardware_mapping.c_str();
+    defaults.rows = mc.rows;
+    defaults.cols = mc.cols;
+    defaults.chain_length = mc.chain_length;
+    defaults.parallel = mc.parallel;
+    defaults.pwm_bits = mc.pwm_bits;
+    defaults.pwm_lsb_nanoseconds = mc.pwm_lsb_nanoseconds;
+    defaults.brightness = mc.brightness;
+    defaults.limit_refresh_rate_hz = mc.limit_refresh_rate_hz;
+
+    rgb_matrix::RuntimeOptions runtime_opt;
+    runtime_opt.gpio_slowdown = mc.gpio_slowdown;
+    runtime_opt.drop_privileges = mc.drop_privileges ? 1 : 0;
+
+    return RGBMatrix::CreateFromOptions(defaults, runtime_opt);
+}
+
+// --- 統計 ---
+// 所要時間の分布 (Prometheus の histogram と同じ累積バケットで出力する)
+struct Histogram
+{
+    static constexpr int MAX_BUCKETS = 8;
+    std::vector<double> bounds; // 各バケットの上限(秒)、昇順
+    std::atomic<unsigned long> counts[MAX_BUCKETS + 1] = {}; // 最後は上限なし
+    std::atomic<unsigned long long> sum_ns{0};
+
+    explicit Histogram(std::initializer_list<double> upper) : bounds(upper) {}
+
+    void observe(std::chrono::steady_clock::duration d)
+    {
+        double sec = std::chrono::duration<double>(d).count();
+        size_t i = 0;
+        while (i < bounds.size() && sec > bounds[i])
+            ++i;
+        counts[i]++;
+        sum_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    }
+};
+
+// 読み込みスレッドと描画スレッドの両方が数えるため atomic にする
+struct Metrics
+{
+    std::atomic<unsigned long> reloads{0};              // 入力ファイルの確認回数 (ファイル単位)
+    std::atomic<unsigned long> reloads_parsed{0};       // 内容が変わり解析した回数
+    std::atomic<unsigned long> reloads_skipped_stat{0}; // inode/mtime/size が同じで読み込みを省いた回数
+    std::atomic<unsigned long> reloads_skipped_hash{0}; // 書き直されたが内容が同じで解析を省いた回数
+    std::atomic<unsigned long> parse_errors{0};
+    std::atomic<unsigned long> ticker_rebuilds{0};      // 入力が変わりメッセージを作り直した回数
+    std::atomic<unsigned long> unknown_types{0};        // 色の決まらなかった種別 (一覧に語彙を足す目安)
+    std::atomic<unsigned long> dropped_frames{0};       // スクロール中に間に合わなかったフレーム数
+    Histogram frame_time{0.001, 0.002, 0.005, 0.01, 0.02, 0.05}; // 描画からスワップまで
+    Histogram load_time{0.001, 0.005, 0.01, 0.05, 0.1, 0.5};    // 読み込みスレッドの1回分 (全入力ファイル)
+};
+Metrics metrics;
+
+void print_metrics(const Metrics &m)
+{
+    fprintf(stderr, "reloads=%lu parsed=%lu skipped_stat=%lu skipped_hash=%lu parse_errors=%lu ticker_rebuilds=%lu unknown_types=%lu\n",
+            m.reloads.load(), m.reloads_parsed.load(), m.reloads_skipped_stat.load(), m.reloads_skipped_hash.load(),
+            m.parse_errors.load(), m.ticker_rebuilds.load(), m.unknown_types.load());
+}
+
+// --- トレース ---
+// フレームの各段階・読み込みの各段階の開始と終了をスレッドごとのリングバッファに記録し、
+// Chrome のトレース形式 (Perfetto で開ける) で書き出す。
+// 記録はそのスレッドだけが書くのでロックを取らず、無効のときは時刻も取らない
+const size_t TRACE_RING_EVENTS = 4096;            // スレッドごとに残す件数
+const int TRACE_DUMP_MIN_INTERVAL_SECONDS = 10;   // フレーム超過による自動書き出しの最短間隔
+
+uint64_t trace_now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct TraceEvent
+{
+    const char *name;     // 文字列リテラルのみ
+    const char *category;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+};
+
+// 書くのは持ち主のスレッドだけで、書き出し時に別のスレッドが読む。
+// 各枠は seqlock で、seq に「何件目の記録か」を入れる (h 件目を書いている間は 2h+1、書き終えたら 2h+2)
+class TraceRing
+{
+public:
+    TraceRing(const char *thread_name)
+        : name(thread_name), tid(static_cast<pid_t>(syscall(SYS_gettid))), slots_(TRACE_RING_EVENTS) {}
+
+    void push(const TraceEvent &ev)
+    {
+        uint64_t h = head_.load(std::memory_order_relaxed);
+        Slot &slot = slots_[h % slots_.size()];
+        slot.seq.store(2 * h + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store(ev.name, std::memory_order_relaxed);
+        slot.category.store(ev.category, std::memory_order_relaxed);
+        slot.begin_ns.store(ev.begin_ns, std::memory_order_relaxed);
+        slot.end_ns.store(ev.end_ns, std::memory_order_relaxed);
+        slot.seq.store(2 * h + 2, std::memory_order_release);
+        head_.store(h + 1, std::memory_order_release);
+    }
+
+    // 記録中でも読める。読む前後で seq が目当ての記録の書き終わりでない枠 (書き込み中・上書き済み) は捨てる
+    void snapshot(std::vector<TraceEvent> &out) const
+    {
+        const uint64_t cap = slots_.size();
+        uint64_t end = head_.load(std::memory_order_acquire);
+        uint64_t begin = end > cap ? end - cap : 0;
+        for (uint64_t i = begin; i < end; ++i)
+        {
+            const Slot &slot = slots_[i % cap];
+            const uint64_t done = 2 * i + 2;
+            if (slot.seq.load(std::memory_order_acquire) != done)
+                continue;
+            TraceEvent ev{slot.name.load(std::memory_order_relaxed), slot.category.load(std::memory_order_relaxed),
+                          slot.begin_ns.load(std::memory_order_relaxed), slot.end_ns.load(std::memory_order_relaxed)};
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != done)
+                continue;
+            out.push_back(ev);
+        }
+    }
+
+    const char *name;
+    const pid_t tid;
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<const char *> name{nullptr};
+        std::atomic<const char *> category{nullptr};
+        std::atomic<uint64_t> begin_ns{0};
+        std::atomic<uint64_t> end_ns{0};
+    };
+    std::vector<Slot> slots_;
+    std::atomic<uint64_t> head_{0};
+};
+
+class Tracer
+{
+public:
+    ~Tracer() { wait_writer(); }
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+    void set_enabled(bool on) { enabled_.store(on, std::memory_order_relaxed); }
+
+    // 呼び出したスレッドのリングを作る (スレッドの開始時に1回)
+    void register_thread(const char *name)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.emplace_back(new TraceRing(name));
+        thread_ring_ = rings_.back().get();
+    }
+
+    void record(const char *name, const char *category, uint64_t begin_ns, uint64_t end_ns)
+    {
+        if (thread_ring_ != nullptr)
+            thread_ring_->push({name, category, begin_ns, end_ns});
+    }
+
+    // 全スレッドの記録を写し取り、別スレッドでファイルに書く (SDカードへの書き込みで描画を止めない)。
+    // 書き出し先のパスを返す。前の書き出しが終わっていなければ何もせず空を返す
+    std::string dump(const std::string &dir, const char *reason)
+    {
+        if (writing_.load(std::memory_order_acquire))
+            return "";
+        wait_writer(); // 書き終えたスレッドを片付ける
+
+        std::vector<Thread> threads;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto &ring : rings_)
+            {
+                threads.push_back({ring->name, ring->tid, {}});
+                ring->snapshot(threads.back().events);
+            }
+        }
+
+        char stamp[32];
+        std::time_t t_now = std::time(nullptr);
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::localtime(&t_now));
+        std::string path = dir + "/draw_matrix-trace-" + stamp + "-" + reason + ".json";
+
+        writing_.store(true, std::memory_order_release);
+        writer_ = std::thread([this, path, threads = std::move(threads)] {
+            write_trace(path, threads);
+            writing_.store(false, std::memory_order_release);
+        });
+        return path;
+    }
+
+    // 書き出し中のスレッドが終わるのを待つ (終了時に main から呼ぶ)
+    void wait_writer()
+    {
+        if (writer_.joinable())
+            writer_.join();
+    }
+
+private:
+    struct Thread
+    {
+        const char *name;
+        pid_t tid;
+        std::vector<TraceEvent> events;
+    };
+
+    static void write_trace(const std::string &path, const std::vector<Thread> &threads)
+    {
+        FILE *f = fopen(path.c_str(), "w");
+        if (f == nullptr)
+        {
+            fprintf(stderr, "Couldn't write trace '%s': %s\n", path.c_str(), strerror(errno));
+            return;
+        }
+        int pid = static_cast<int>(getpid());
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        for (const Thread &th : threads)
+        {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", pid, static_cast<int>(th.tid), th.name);
+            first = false;
+            for (const TraceEvent &ev : th.events)
+            {
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        ev.name, ev.category, ev.begin_ns / 1e3, (ev.end_ns - ev.begin_ns) / 1e3,
+                        pid, static_cast<int>(th.tid));
+            }
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        fprintf(stderr, "Trace written to '%s'\n", path.c_str());
+    }
+
+    std::thread writer_;
+    std::atomic<bool> writing_{false};
+
+    std::atomic<bool> enabled_{false};
+    std::mutex mutex_; // rings_ の追加と書き出し時の走査だけ
+    std::vector<std::unique_ptr<TraceRing>> rings_;
+    static thread_local TraceRing *thread_ring_;
+};
+thread_local TraceRing *Tracer::thread_ring_ = nullptr;
+Tracer tracer;
+
+// スコープの開始から終了 (または end()) までを1件として記録する
+class TraceScope
+{
+public:
+    TraceScope(const char *name, const char *category)
+        : name_(name), category_(category), begin_ns_(tracer.enabled() ? trace_now_ns() : 0) {}
+    ~TraceScope() { end(); }
+
+    void end()
+    {
+        if (begin_ns_ != 0)
+            tracer.record(name_, category_, begin_ns_, trace_now_ns());
+        begin_ns_ = 0;
+    }
+
+private:
+    const char *name_;
+    const char *category_;
+    uint64_t begin_ns_;
+};
+
+// --- 入力ファイルの変更検出 ---
+// XXH64 (xxHash 64bit)
+uint64_t xxh64(const void *input, size_t len, uint64_t seed = 0)
+{
+    const uint64_t P1 = 11400714785074694791ULL;
+    const uint64_t P2 = 14029467366897019727ULL;
+    const uint64_t P3 = 1609587929392839161ULL;
+    const uint64_t P4 = 9650029242287828579ULL;
+    const uint64_t P5 = 2870177450012600261ULL;
+
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const uint8_t *p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const uint8_t *p) { uint32_t v; std::memcpy(&v, p, 4); return static_cast<uint64_t>(v); };
+    auto round = [&](uint64_t acc, uint64_t lane) { return rotl(acc + lane * P2, 31) * P1; };
+    auto merge = [&](uint64_t acc, uint64_t val) { return (acc ^ round(0, val)) * P1 + P4; };
+
+    const uint8_t *p = static_cast<const uint8_t *>(input);
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        do
+        {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    }
+    else
+    {
+        h = seed + P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end)
+    {
+        h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = rotl(h ^ (*p * P5), 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// 入力ファイル1つの1回分の解析結果。DOM はすべて arena に置き、arena と一緒に捨てる
+struct InputSnapshot
+{
+    std::unique_ptr<JsonArena> arena; // doc より先に宣言する (doc を先に壊す)
+    input_json doc;
+
+    InputSnapshot() = default;
+    InputSnapshot(InputSnapshot &&o) noexcept : arena(std::move(o.arena)), doc(std::move(o.doc)) {}
+    InputSnapshot &operator=(InputSnapshot &&o) noexcept
+    {
+        doc = nullptr; // 古い DOM は古い arena が残っているうちに壊す
+        arena = std::move(o.arena);
+        doc = std::move(o.doc);
+        return *this;
+    }
+};
+
+// 入力ファイルの最後に読み込んだ状態
+// (inode, mtime, size) が同じなら読み込まず、書き直されていても内容のハッシュが同じなら解析しない
+struct InputFile
+{
+    std::string path;
+    bool exists = false;
+    ino_t inode = 0;
+    struct timespec mtime = {0, 0};
+    off_t size = 0;
+    uint64_t hash = 0;
+    size_t arena_used = 0; // 前回の解析で使ったアリーナの大きさ (次のアリーナの最初の塊にする)
+};
+
+// 入力ファイルを確認し、内容が変わっていれば解析して out に入れる。変わったら true
+bool refresh_input(InputFile &file, InputSnapshot &out)
+{
+    metrics.reloads++;
+
+    TraceScope stat_trace("stat", "loader");
+    struct stat st;
+    if (stat(file.path.c_str(), &st) != 0)
+    {
+        // ファイルなし
+        bool changed = file.exists;
+        file = InputFile{file.path};
+        if (changed)
+            out = InputSnapshot();
+        return changed;
+    }
+
+    if (file.exists && st.st_ino == file.inode && st.st_size == file.size &&
+        st.st_mtim.tv_sec == file.mtime.tv_sec && st.st_mtim.tv_nsec == file.mtime.tv_nsec)
+    {
+        metrics.reloads_skipped_stat++;
+        return false;
+    }
+    stat_trace.end();
+
+    TraceScope read_trace("read", "loader");
+    std::ifstream i(file.path, std::ios::binary);
+    if (!i.is_open())
+        return false;
+    std::string bytes((std::istreambuf_iterator<char>(i)), std::istreambuf_iterator<char>());
+    read_trace.end();
+    uint64_t hash = xxh64(bytes.data(), bytes.size());
+
+    bool was_present = file.exists;
+    file.exists = true;
+    file.inode = st.st_ino;
+    file.mtime = st.st_mtim;
+    file.size = st.st_size;
+    if (was_present && hash == file.hash)
+    {
+        metrics.reloads_skipped_hash++;
+        return false;
+    }
+    file.hash = hash;
+
+    metrics.reloads_parsed++;
+    TraceScope parse_trace("parse", "loader");
+    InputSnapshot parsed;
+    parsed.arena.reset(new JsonArena(file.arena_used));
+    {
+        JsonArena::Scope scope(parsed.arena.get());
+        parsed.doc = input_json::parse(bytes, nullptr, false);
+    }
+    file.arena_used = parsed.arena->used();
+    if (parsed.doc.is_discarded())
+    {
+        metrics.parse_errors++;
+        parsed = InputSnapshot();
+    }
+    out = std::move(parsed);
+    return true;
+}
+
+// --- 発車情報 ---
+// 1方面分の表示内容。departure.json でその方面が変わったときだけ作り直す
+struct DepartureRow
+{
+    bool valid = false;      // 経路が見つからなかった方面は空行にする
+    std::string dest_name;   // 方面 (departure.json のキー)
+    std::string direction;   // A面の表示 ("○○方面")
+    std::string line_type;   // 種別
+    std::string dep_time;    // 発車時刻 "HH:MM"
+    std::string destination; // 行先
+    std::string status;      // 始発/終電
+    ColorRGB type_color = COL_WHITE;
+    std::time_t dep_epoch = -1; // 発車時刻 (読めなければ -1)
+    int pin = -1;               // 固定する行 (-1: 発車時刻順)
+};
+
+// 種別名から表示色を決める。一覧にあればそのまま、なければ含まれている最も長い種別名の色
+// (「ＪＲ快速」→「快速」)。どれも含まれなければ白にして統計に数える
+ColorRGB classify_type_color(const std::string &line_type)
+{
+    int index = lookup_train_type(line_type);
+    if (index >= 0)
+        return TRAIN_TYPE_COLORS[index].color;
+
+    if (!line_type.empty())
+    {
+        for (uint8_t i : TYPE_TABLE.longest_first)
+        {
+            if (line_type.find(TRAIN_TYPE_COLORS[i].name) != std::string::npos)
+                return TRAIN_TYPE_COLORS[i].color;
+        }
+    }
+    metrics.unknown_types++;
+    return COL_WHITE;
+}
+
+// "HH:MM" を t_now 以降の発車時刻に直す。3時より前は翌日扱い
+std::time_t departure_epoch(const std::string &dep_time, const std::string &status, std::time_t t_now)
+{
+    int dep_hour, dep_min;
+    if (sscanf(dep_time.c_str(), "%d:%d", &dep_hour, &dep_min) != 2)
+        return -1;
+
+    std::tm tm_now_calc = *std::localtime(&t_now);
+    std::tm tm_dep = tm_now_calc;
+    tm_dep.tm_hour = dep_hour;
+    tm_dep.tm_min = dep_min;
+    tm_dep.tm_sec = 0;
+
+    if (dep_hour < 3 && tm_now_calc.tm_hour >= 3)
+    {
+        tm_dep.tm_mday += 1;
+    }
+    std::time_t t_dep = std::mktime(&tm_dep);
+
+    // 始発は翌朝の時刻が入ってくる
+    if (status == "始発" && t_dep < t_now)
+    {
+        tm_dep.tm_mday += 1;
+        t_dep = std::mktime(&tm_dep);
+    }
+    return t_dep;
+}
+
+DepartureRow make_departure_row(const std::string &key, const input_json &val, std::time_t t_now)
+{
+    DepartureRow row;
+    row.dest_name = key;
+    row.direction = key + "方面";
+
+    if (!val.is_null() && val.contains("segments") && !val["segments"].empty())
+    {
+        const input_json &seg = val["segments"][0];
+        row.valid = true;
+        row.line_type = seg.value("type", "");
+        row.dep_time = val.value("departure_time", "--:--");
+        row.destination = seg.value("destination", "");
+        row.status = val.value("status", "");
+        row.type_color = classify_type_color(row.line_type);
+        row.dep_epoch = departure_epoch(row.dep_time, row.status, t_now);
+    }
+
+    auto pin = config.pinned_rows.find(key);
+    if (pin != config.pinned_rows.end())
+        row.pin = pin->second;
+    return row;
+}
+
+
+bool same_row(const DepartureRow &a, const DepartureRow &b)
+{
+    return a.valid == b.valid && a.line_type == b.line_type && a.dep_time == b.dep_time &&
+           a.destination == b.destination && a.status == b.status && a.dep_epoch == b.dep_epoch &&
+           a.pin == b.pin;
+}
+
+// 発車の早い順。時刻の分からない方面は後ろへ、同時刻は方面名順
+bool departs_before(const DepartureRow &a, const DepartureRow &b)
+{
+    bool a_known = a.valid && a.dep_epoch >= 0;
+    bool b_known = b.valid && b.dep_epoch >= 0;
+    if (a_known != b_known)
+        return a_known;
+    if (a_known && a.dep_epoch != b.dep_epoch)
+        return a.dep_epoch < b.dep_epoch;
+    return a.dest_name < b.dest_name;
+}
+
+bool pinned_before(const DepartureRow &a, const DepartureRow &b)
+{
+    if (a.pin != b.pin)
+        return a.pin < b.pin;
+    return a.dest_name < b.dest_name;
+}
+
+// 表示順を保った発車情報。変わった方面だけ抜いて挿し直す
+struct DepartureBoard
+{
+    std::vector<DepartureRow> sorted; // 固定しない方面 (発車時刻順)
+    std::vector<DepartureRow> pinned; // 行を固定した方面 (行番号順)
+    std::vector<DepartureRow> rows;   // 表示順 (固定行を差し込んだもの)
+};
+
+// 固定行を指定の位置に、残りを発車順に詰めて表示順を作る
+void merge_departure_rows(DepartureBoard &board)
+{
+    board.rows.clear();
+    size_t total = board.sorted.size() + board.pinned.size();
+    auto s = board.sorted.begin();
+    auto p = board.pinned.begin();
+    for (int slot = 0; board.rows.size() < total; ++slot)
+    {
+        if (p != board.pinned.end() && (p->pin <= slot || s == board.sorted.end()))
+            board.rows.push_back(*p++);
+        else
+            board.rows.push_back(*s++);
+    }
+}
+
+// departure.json の内容を反映する。表示が変わったら true
+bool update_departure_board(DepartureBoard &board, const input_json &departure, std::time_t t_now)
+{
+    static const input_json empty_object = input_json::object();
+    const input_json &items = departure.is_object() ? departure : empty_object;
+    bool changed = false;
+
+    // なくなった方面を外す
+    auto gone = [&](const DepartureRow &r) { return !items.contains(r.dest_name.c_str()); };
+    for (auto *list : {&board.sorted, &board.pinned})
+    {
+        auto it = std::remove_if(list->begin(), list->end(), gone);
+        if (it != list->end())
+        {
+            list->erase(it, list->end());
+            changed = true;
+        }
+    }
+
+    for (auto &el : items.items())
+    {
+        DepartureRow row = make_departure_row(std::string(el.key()), el.value(), t_now);
+
+        auto by_name = [&](const DepartureRow &r) { return r.dest_name == row.dest_name; };
+        std::vector<DepartureRow> *list = &board.sorted;
+        auto it = std::find_if(list->begin(), list->end(), by_name);
+        if (it == list->end())
+        {
+            list = &board.pinned;
+            it = std::find_if(list->begin(), list->end(), by_name);
+        }
+        if (it != list->end())
+        {
+            if (same_row(*it, row))
+                continue;
+            list->erase(it);
+        }
+
+        // 並びを保ったまま挿し直す
+        if (row.pin >= 0)
+            board.pinned.insert(std::lower_bound(board.pinned.begin(), board.pinned.end(), row, pinned_before), std::move(row));
+        else
+            board.sorted.insert(std::lower_bound(board.sorted.begin(), board.sorted.end(), row, departs_before), std::move(row));
+        changed = true;
+    }
+
+    if (changed)
+        merge_departure_rows(board);
+    return changed;
+}
+
+// 発車情報に出てくる路線名 (重複なし)。メッセージ中の路線名の強調に使う
+std::vector<std::string> departure_lines(const input_json &departure)
+{
+    std::vector<std::string> lines;
+    if (!departure.is_object())
+        return lines;
+    for (auto &el : departure.items())
+    {
+        const input_json &val = el.value();
+        if (val.is_null() || !val.contains("segments") || !val["segments"].is_array())
+            continue;
+        for (const auto &seg : val["segments"])
+        {
+            std::string line(seg.value("line", ""));
+            if (!line.empty())
+                lines.push_back(line);
+        }
+    }
+    std::sort(lines.begin(), lines.end());
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+    return lines;
+}
+
+// 「N分後」の表示 (0〜99分)。毎分の描き直しで文字列を作らないように起動時に並べておく
+struct MinutesLabels
+{
+    static constexpr int COUNT = 100;
+    char text[COUNT][12];
+
+    MinutesLabels()
+    {
+        for (int n = 0; n < COUNT; ++n)
+            snprintf(text[n], sizeof(text[n]), "%d分後", n);
+    }
+};
+const MinutesLabels MINUTES_LABELS;
+
+// A面の残り時間表示 (「N分後」/始発/終電) と色。返す文字列は静的な領域を指す
+const char *departure_countdown(const DepartureRow &row, std::time_t t_now, ColorRGB &time_col)
+{
+    time_col = COL_GREEN;
+
+    if (row.status == "始発")
+    {
+        time_col = COL_BLUE;
+        return "始発";
+    }
+    if (row.status == "終電")
+    {
+        time_col = COL_RED;
+        return "終電";
+    }
+
+    if (row.dep_epoch < 0)
+        return "--:--";
+
+    double diff_seconds = std::difftime(row.dep_epoch, t_now);
+    int diff_minutes = static_cast<int>(diff_seconds / 60.0) + 1;
+
+    if (diff_minutes >= MinutesLabels::COUNT)
+    {
+        time_col = COL_BLUE;
+        return "始発";
+    }
+
+    // 発車時刻を過ぎた行は入力が更新されるまで 0分後 のまま出す
+    diff_minutes = std::max(0, diff_minutes);
+    if (diff_minutes <= config.red_minutes)
+        time_col = COL_RED;
+    else if (diff_minutes <= config.yellow_minutes)
+        time_col = COL_YELLOW;
+    else
+        time_col = COL_GREEN;
+    return MINUTES_LABELS.text[diff_minutes];
+}
+
+// データ保持用構造体
+struct DisplayData
+{
+    InputSnapshot departure;
+    InputSnapshot operation;
+    InputSnapshot weather;
+    InputSnapshot first_last;
+    ServiceHours service;
+    TickerScheduler ticker;
+    DepartureBoard board;
+    std::vector<std::string> route_lines; // 強調表示に入れている路線名
+    RelevanceIndex relevance;             // 運行情報の絞り込み
+
+    // 制御ソケットから流すよう指示されたメッセージ (表示の確認用)
+    struct Injected
+    {
+        std::string text;
+        int seconds;
+        std::chrono::steady_clock::time_point expires;
+    };
+    std::vector<Injected> injected;
+};
+
+// 読み込みスレッドが解析した入力。changed が false の項目は前回から変わっていない
+struct LoadedInputs
+{
+    enum
+    {
+        DEPARTURE,
+        OPERATION,
+        WEATHER,
+        FIRST_LAST,
+        COUNT
+    };
+    InputSnapshot values[COUNT];
+    bool changed[COUNT] = {};
+};
+
+// 入力ファイルの確認・読み込み・JSON解析を描画とは別のスレッドで行う。
+// 描画スレッドは take() で結果を受け取るだけなので、解析中もフレームが遅れない
+class InputLoader
+{
+public:
+    InputLoader() : notify_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+    ~InputLoader()
+    {
+        stop();
+        if (notify_fd_ >= 0)
+            close(notify_fd_);
+    }
+
+    // 最初の1回は呼び出し元で読み込み、起動直後の画面に間に合わせる
+    void start(const Config &c, int reload_seconds)
+    {
+        configure(c, reload_seconds);
+        load_pass();
+        worker_ = std::thread(&InputLoader::run, this);
+    }
+
+    // 結果ができると読める状態になる fd (描画スレッドのイベントループで待つ)
+    int notify_fd() const { return notify_fd_; }
+
+    // notify_fd() の通知を読み捨てる
+    void clear_notify()
+    {
+        uint64_t count;
+        while (read(notify_fd_, &count, sizeof(count)) == sizeof(count))
+        {
+        }
+    }
+
+    // キャッシュを捨ててすべての入力ファイルを読み直す
+    void reload_all()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reload_all_ = true;
+            wake_requested_ = true;
+        }
+        wake_cv_.notify_all();
+    }
+
+    // 入力ファイルの最終更新時刻 (なければ 0)
+    std::time_t input_mtime(int k) const { return mtimes_[k].load(); }
+
+    // 入力ファイルが書き換えられたので、間隔を待たずに読み込む
+    void kick()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_requested_ = true;
+        }
+        wake_cv_.notify_all();
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_cv_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    // パスと読み込み間隔を設定する。パスが変わったファイルは次の読み込みで必ず解析する。
+    // reload_seconds が 0 なら定期的には読まず、kick() されたときだけ読む
+    void configure(const Config &c, int reload_seconds)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            paths_[LoadedInputs::DEPARTURE] = c.departure_file;
+            paths_[LoadedInputs::OPERATION] = c.operation_file;
+            paths_[LoadedInputs::WEATHER] = c.weather_file;
+            paths_[LoadedInputs::FIRST_LAST] = c.first_last_file;
+            cpu_ = c.loader_cpu;
+            reload_seconds_ = reload_seconds;
+            wake_requested_ = true;
+        }
+        wake_cv_.notify_all();
+    }
+
+    // 新しい結果があれば受け取る (前回の take() 以降に複数回読み込んでいればまとめて1つになる)
+    bool take(LoadedInputs &out)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!has_result_)
+            return false;
+        out = std::move(result_);
+        result_ = LoadedInputs();
+        has_result_ = false;
+        return true;
+    }
+
+private:
+    void run()
+    {
+        // シグナルはメインスレッドで受ける
+        sigset_t mask;
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+        // 描画スレッドの SCHED_FIFO を引き継がないよう通常のスケジューリングに戻す
+        set_thread_priority(pthread_self(), 0, "loader");
+        tracer.register_thread("loader");
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        int pinned_cpu = -2; // まだ固定していない
+        while (!stopping_)
+        {
+            if (cpu_ != pinned_cpu)
+            {
+                pinned_cpu = cpu_;
+                pin_thread(pthread_self(), pinned_cpu, "loader");
+            }
+            auto woken = [this] { return stopping_ || wake_requested_; };
+            if (reload_seconds_ > 0)
+                wake_cv_.wait_for(lock, std::chrono::seconds(reload_seconds_), woken);
+            else
+                wake_cv_.wait(lock, woken);
+            if (stopping_)
+                break;
+            lock.unlock();
+            load_pass();
+            lock.lock();
+        }
+    }
+
+    // 全入力ファイルを確認し、結果を描画スレッドに渡す
+    void load_pass()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int k = 0; k < LoadedInputs::COUNT; ++k)
+            {
+                if (files_[k].path != paths_[k] || reload_all_)
+                    files_[k] = InputFile{paths_[k]};
+            }
+            wake_requested_ = false;
+            reload_all_ = false;
+        }
+
+        TraceScope pass_trace("load_pass", "loader");
+        auto started = std::chrono::steady_clock::now();
+        LoadedInputs loaded;
+        for (int k = 0; k < LoadedInputs::COUNT; ++k)
+        {
+            loaded.changed[k] = refresh_input(files_[k], loaded.values[k]);
+            mtimes_[k] = files_[k].exists ? files_[k].mtime.tv_sec : 0;
+        }
+        metrics.load_time.observe(std::chrono::steady_clock::now() - started);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int k = 0; k < LoadedInputs::COUNT; ++k)
+            {
+                if (loaded.changed[k])
+                {
+                    result_.values[k] = std::move(loaded.values[k]);
+                    result_.changed[k] = true;
+                }
+            }
+            has_result_ = true;
+        }
+        uint64_t one = 1;
+        if (write(notify_fd_, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "loader: couldn't notify render thread: %s\n", strerror(errno));
+    }
+
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable wake_cv_; // 読み込みスレッドを起こす (設定変更・ファイル変更・終了)
+    int notify_fd_;                   // 描画スレッドを起こす (読み込み完了)
+    bool stopping_ = false;
+    bool wake_requested_ = false;
+    bool reload_all_ = false;
+    std::atomic<std::time_t> mtimes_[LoadedInputs::COUNT] = {};
+    std::string paths_[LoadedInputs::COUNT];
+    int cpu_ = -1;
+    int reload_seconds_ = 2;
+    LoadedInputs result_;
+    bool has_result_ = false;
+
+    InputFile files_[LoadedInputs::COUNT]; // 読み込みスレッドだけが触る
+};
+
+// 入力ファイルの置き場所を inotify で見張り、書き込み・置き換え・削除を知らせる。
+// 取得スクリプトは一時ファイルからの rename (IN_MOVED_TO) か直接の書き込み (IN_CLOSE_WRITE) で更新する
+class InputWatcher
+{
+public:
+    InputWatcher() : fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {}
+    ~InputWatcher()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    int fd() const { return fd_; }
+
+    // すべての置き場所を見張れているか (false なら読み込みスレッドの定期確認に任せる)
+    bool active() const { return active_; }
+
+    void watch(const std::vector<std::string> &paths)
+    {
+        for (const auto &entry : dirs_)
+            inotify_rm_watch(fd_, entry.first);
+        dirs_.clear();
+        active_ = fd_ >= 0;
+        if (!active_)
+            return;
+
+        for (const std::string &path : paths)
+        {
+            size_t slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+            int wd = inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+            if (wd < 0)
+            {
+                fprintf(stderr, "Couldn't watch '%s': %s\n", dir.c_str(), strerror(errno));
+                active_ = false;
+                continue;
+            }
+            dirs_[wd].insert(name); // 同じディレクトリは同じ wd になる
+        }
+    }
+
+    // たまったイベントを読み、見張っているファイルに関係するものがあれば true
+    bool drain()
+    {
+        alignas(inotify_event) char buf[4096];
+        bool relevant = false;
+        ssize_t len;
+        while ((len = read(fd_, buf, sizeof(buf))) > 0)
+        {
+            for (char *p = buf; p < buf + len;)
+            {
+                const inotify_event *ev = reinterpret_cast<const inotify_event *>(p);
+                auto it = dirs_.find(ev->wd);
+                if (ev->mask & IN_Q_OVERFLOW)
+                    relevant = true; // 取りこぼしたので全部確認する
+                else if ((ev->mask & IN_IGNORED) && it != dirs_.end())
+                {
+                    // ディレクトリが消えた。以降は定期確認に任せる
+                    // (watch() で外した古い wd の IN_IGNORED は dirs_ にないので無視する)
+                    dirs_.erase(it);
+                    active_ = false;
+                    relevant = true;
+                }
+                else if (ev->len > 0 && it != dirs_.end() && it->second.count(ev->name))
+                    relevant = true;
+                p += sizeof(inotify_event) + ev->len;
+            }
+        }
+        return relevant;
+    }
+
+private:
+    int fd_;
+    bool active_ = false;
+    std::map<int, std::set<std::string>> dirs_; // wd → 見張っているファイル名
+};
+
+// --- 夜間モード (終電後〜始発前) ---
+// 3時を日付の境目とした分 (0〜2時台は前日の24〜26時として扱う)
+int service_minutes(int hour, int minute)
+{
+    int minutes = hour * 60 + minute;
+    if (hour < 3)
+        minutes += 24 * 60;
+    return minutes;
+}
+
+// first_last_train.json から営業時間を求める
+ServiceHours parse_service_hours(const input_json &first_last)
+{
+    ServiceHours hours;
+    if (first_last.is_null() || !first_last.is_object())
+        return hours;
+
+    int first = 24 * 60 * 2;
+    int last = -1;
+    for (auto &el : first_last.items())
+    {
+        const input_json &val = el.value();
+        if (!val.is_object())
+            continue;
+
+        int h, m;
+        if (val.contains("first_train") && val["first_train"].is_object() &&
+            sscanf(val["first_train"].value("departure", "").c_str(), "%d:%d", &h, &m) == 2)
+            first = std::min(first, service_minutes(h, m));
+        if (val.contains("last_train") && val["last_train"].is_object() &&
+            sscanf(val["last_train"].value("departure", "").c_str(), "%d:%d", &h, &m) == 2)
+            last = std::max(last, service_minutes(h, m));
+    }
+
+    // 始発・終電の両方が揃い、順序が正しい場合のみ有効
+    if (last >= 0 && first < last)
+    {
+        hours.valid = true;
+        hours.first_minutes = first;
+        hours.last_minutes = last;
+    }
+    return hours;
+}
+
+// 現在が夜間 (終電+猶予 〜 始発-復帰オフセット) かどうか
+bool is_night_time(const ServiceHours &hours, const std::tm &tm_now)
+{
+    if (!config.night_enabled || !hours.valid)
+        return false;
+    int now = service_minutes(tm_now.tm_hour, tm_now.tm_min);
+    return now >= hours.last_minutes + config.last_train_grace_minutes ||
+           now < hours.first_minutes - config.wake_before_first_minutes;
+}
+
+// 経路の路線名か設定が変わったときに、強調表示と運行情報の絞り込みを作り直す
+void rebuild_line_index(DisplayData &data)
+{
+    build_highlighter(data.route_lines);
+    data.ticker.rehighlight();
+    data.relevance.build(data.route_lines, config.watch_lines);
+}
+
+// 運行情報の種類
+enum OperationKind
+{
+    OP_SUSPEND = 0, // 運転見合わせ
+    OP_DELAY = 1,   // 遅延
+    OP_TROUBLE = 2, // その他のお知らせ
+};
+
+// 種類と経路との関係ごとの流し方
+struct OperationRule
+{
+    bool show;
+    int priority;
+    int weight;
+    int min_repeat_seconds;
+};
+constexpr OperationRule OPERATION_RULES[3][3] = {
+    // 関係なし (show_elsewhere のときだけ)   watch_lines                        経路上
+    {{true, PRIO_INFO, 1, 120}, {true, PRIO_NOTICE, 2, 0}, {true, PRIO_URGENT, 3, 0}}, // 見合わせ
+    {{true, PRIO_INFO, 1, 300}, {true, PRIO_INFO, 1, 60}, {true, PRIO_NOTICE, 2, 0}},  // 遅延
+    {{false, PRIO_INFO, 1, 0}, {true, PRIO_INFO, 1, 300}, {true, PRIO_INFO, 1, 60}},   // お知らせ
+};
+
+// スクロールメッセージの構築
+// 重み・最短再表示間隔は「見合わせ > 遅延 > 日付・天気」の頻度になるよう設定
+// 内容が変わらないメッセージは touch() で存在を確認するだけにして、文字列の組み立てと計測を省く
+TickerDiff update_scroll_messages(DisplayData &data, const DisplayFont &font)
+{
+    TraceScope trace("ticker_rebuild", "render");
+    TickerScheduler &ticker = data.ticker;
+    auto now = std::chrono::steady_clock::now();
+    ticker.begin_sync();
+
+    // ★★★ 追加: 日付メッセージ ★★★
+    {
+        std::time_t t_now = std::time(nullptr);
+        std::tm *tm_now = std::localtime(&t_now);
+        const char *wday_name[] = {"日", "月", "火", "水", "木", "金", "土"};
+
+        char date_buf[64];
+        // "本日は MM月DD日（{曜日}）です" の形式を作成
+        std::sprintf(date_buf, "本日は %02d月%02d日（%s）です",
+                     tm_now->tm_mon + 1,
+                     tm_now->tm_mday,
+                     wday_name[tm_now->tm_wday]);
+
+        uint64_t id = message_id({"date", date_buf});
+        if (!ticker.touch(id))
+            ticker.add(id, make_message(date_buf, COL_WHITE, PRIO_INFO, 1, 30), font, now); // 白で表示
+    }
+
+    // 0. 制御ソケットから指示されたメッセージ (期限まで緊急扱いで流す)
+    data.injected.erase(std::remove_if(data.injected.begin(), data.injected.end(),
+                                       [&](const DisplayData::Injected &m) { return m.expires <= now; }),
+                        data.injected.end());
+    for (const auto &m : data.injected)
+    {
+        uint64_t id = message_id({"injected", m.text});
+        if (!ticker.touch(id))
+            ticker.add(id, make_message(m.text, COL_WHITE, PRIO_URGENT, 3, 0, m.seconds), font, now);
+    }
+
+    // 1. 運行情報 (見合わせ・遅延・お知らせ)。経路との関係で優先度と流すかどうかを決める
+    if (!data.operation.doc.is_null())
+    {
+        struct
+        {
+            OperationKind kind;
+            const char *key;
+            const char *label;
+            ColorRGB color;
+            uint8_t label_style;
+        } const kinds[] = {
+            {OP_SUSPEND, "suspend", "【運転見合わせ】", COL_RED, STYLE_BLINK},
+            {OP_DELAY, "delay", "【遅延】", COL_YELLOW, STYLE_NONE},
+            {OP_TROUBLE, "trouble", "【お知らせ】", COL_CYAN, STYLE_NONE},
+        };
+
+        for (const auto &k : kinds)
+        {
+            if (!data.operation.doc.contains(k.key) || !data.operation.doc[k.key].is_array())
+                continue;
+
+            for (const auto &item : data.operation.doc[k.key])
+            {
+                std::string name(item.value("name", ""));
+                std::string detail(item.value("detail", "詳細不明"));
+                Relevance rel = data.relevance.classify(name);
+                const OperationRule &rule = OPERATION_RULES[k.kind][rel];
+                if (!rule.show || (rel == REL_ELSEWHERE && !config.show_elsewhere))
+                    continue;
+
+                std::vector<TextPart> parts;
+                if (!parts_from_json(item.value("spans", input_json()), k.color, parts))
+                    parts = {{k.label, k.color, k.label_style}, {" " + name, k.color}, {": " + detail, COL_WHITE}};
+                // 経路が変わって関係が変われば別のメッセージとして作り直す
+                static const char *const rel_names[] = {"elsewhere", "nearby", "route"};
+                uint64_t id = message_id({k.key, name, detail, item.value("spans", input_json()).dump(), rel_names[rel]});
+                if (!ticker.touch(id))
+                    ticker.add(id, make_message(ticker.spans, parts, k.color, rule.priority, rule.weight, rule.min_repeat_seconds), font, now);
+            }
+        }
+    }
+
+    // 2. 天気予報
+    if (!data.weather.doc.is_null())
+    {
+        try
+        {
+            std::string area(data.weather.doc.value("area_name", "不明"));
+            std::string weather(data.weather.doc.value("weather", "不明"));
+            std::string office(data.weather.doc.value("publishing_office", " 気象庁"));
+            std::string report_time(data.weather.doc.value("report_time", " "));
+            uint64_t id = message_id({"weather", office, report_time, area, weather});
+            if (!ticker.touch(id))
+                ticker.add(id, make_message("【" + office + " " + report_time + "発表】" + area + "の天気: " + weather, COL_WHITE, PRIO_INFO, 1, 30),
+                           font, now);
+        }
+        catch (...)
+        {
+        }
+    }
+
+    // 運行終了メッセージ/エラーメッセージの追加
+    if (data.departure.doc.is_null() || data.departure.doc.empty())
+    {
+        const char *error_text = "エラーが発生しています。情報が取得できていません";
+        uint64_t id = message_id({"error", error_text});
+        if (!ticker.touch(id))
+            ticker.add(id, make_message(error_text, COL_RED, PRIO_NOTICE, 2), font, now);
+    }
+
+    if (ticker.sync_order == 0)
+    {
+        uint64_t id = message_id({"normal"});
+        if (!ticker.touch(id))
+            ticker.add(id, make_message("平常運転", COL_GREEN, PRIO_INFO, 1), font, now);
+    }
+
+    return ticker.end_sync();
+}
+
+// 描画切替グローバル変数
+bool show_alternate_display = false;
+
+// --- 適応フレームレート ---
+// 画面上で動いているレイヤー。動いているものがなければ描画間隔を延ばす
+enum AnimLayer : unsigned
+{
+    LAYER_NONE = 0,
+    LAYER_TICKER = 1u << 0,  // スクロールメッセージ (50fps)
+    LAYER_COLON = 1u << 1,   // 時計のコロン点滅 (1Hz)
+    LAYER_FACE = 1u << 2,    // A面/B面切替 (toggle_seconds)
+    LAYER_PAGE = 1u << 3,    // ページ切替 (page_seconds)
+    LAYER_MARQUEE = 1u << 4, // 枠に収まらない種別・行先の往復スクロール (marquee_step_ms)
+};
+
+// --- イベントループ ---
+// 描画スレッドは epoll で待つ。次のフレームの時刻は timerfd、シグナルは signalfd、
+// 入力ファイルの変更は inotify、読み込み完了は eventfd で届くため、起きるのは用があるときだけ
+class EventLoop
+{
+public:
+    using Handler = std::function<void(uint32_t events)>;
+
+    EventLoop()
+        : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+          timer_fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    {
+        add(timer_fd_, [this](uint32_t) {
+            uint64_t expirations;
+            while (read(timer_fd_, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+            }
+        });
+    }
+    ~EventLoop()
+    {
+        close(timer_fd_);
+        close(epoll_fd_);
+    }
+
+    bool ok() const { return epoll_fd_ >= 0 && timer_fd_ >= 0; }
+
+    // fd が読めるようになったら handler を呼ぶ
+    bool add(int fd, Handler handler)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (fd < 0 || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0)
+            return false;
+        handlers_[fd] = std::make_shared<Handler>(std::move(handler));
+        return true;
+    }
+
+    void remove(int fd)
+    {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        handlers_.erase(fd);
+    }
+
+    // deadline になるか何か届くまで待ち、届いたものを処理する。deadline が max なら時刻では起きない
+    void wait_until(std::chrono::steady_clock::time_point deadline)
+    {
+        // steady_clock は CLOCK_MONOTONIC なので、そのまま絶対時刻として timerfd に渡せる
+        itimerspec spec{};
+        if (deadline != std::chrono::steady_clock::time_point::max())
+        {
+            long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+            ns = std::max(ns, 1LL); // 0 だとタイマーが止まる
+            spec.it_value.tv_sec = ns / 1000000000LL;
+            spec.it_value.tv_nsec = ns % 1000000000LL;
+        }
+        timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+        epoll_event ready[8];
+        int n = epoll_wait(epoll_fd_, ready, 8, -1);
+        if (n < 0 && errno != EINTR)
+            fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+        for (int i = 0; i < n; ++i)
+        {
+            // 処理の中で自分の fd を外すことがあるので、参照を持ったまま呼ぶ
+            // (std::function の写しは捕捉が大きいと確保を伴うため、毎フレームのタイマーでは避ける)
+            auto it = handlers_.find(ready[i].data.fd);
+            if (it == handlers_.end())
+                continue;
+            std::shared_ptr<Handler> handler = it->second;
+            (*handler)(ready[i].events);
+        }
+    }
+
+private:
+    int epoll_fd_;
+    int timer_fd_;
+    std::map<int, std::shared_ptr<Handler>> handlers_;
+};
+
+// --- 制御用ソケット ---
+// 1行のコマンドを受け取って応答を返し、切断する。"GET /path HTTP/1.x" で始まる行は HTTP として
+// 応答するため、curl --unix-socket や Prometheus の収集エージェントからも読める
+class ControlServer
+{
+public:
+    using Handler = std::function<std::string(const std::string &command)>;
+
+    ~ControlServer() { close_all(); }
+
+    // 権限を手放す前に作る (/run などに置けるように)。失敗しても表示は続ける
+    bool open(const std::string &path)
+    {
+        close_all();
+        path_ = path;
+        sockaddr_un addr{};
+        if (path.empty() || path.size() >= sizeof(addr.sun_path))
+            return false;
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str()); // 前回の残り
+        if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            listen(listen_fd_, MAX_CLIENTS) != 0)
+        {
+            fprintf(stderr, "Couldn't open control socket '%s': %s\n", path.c_str(), strerror(errno));
+            close_all();
+            return false;
+        }
+        chmod(path.c_str(), 0660);
+        return true;
+    }
+
+    int fd() const { return listen_fd_; }
+    const std::string &path() const { return path_; }
+
+    // 接続を受け付け、イベントループに登録する
+    void accept_clients(EventLoop &events, const Handler &handler)
+    {
+        int client;
+        while ((client = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        {
+            if (clients_.size() >= MAX_CLIENTS)
+            {
+                close(client);
+                continue;
+            }
+            clients_[client].clear();
+            events.add(client, [this, &events, handler, client](uint32_t) { serve(events, handler, client); });
+        }
+    }
+
+private:
+    static constexpr size_t MAX_CLIENTS = 8;
+    static constexpr size_t MAX_LINE = 1024;
+
+    void serve(EventLoop &events, const Handler &handler, int client)
+    {
+        std::string &buf = clients_[client];
+        char chunk[256];
+        ssize_t n;
+        bool eof = false;
+        while ((n = read(client, chunk, sizeof(chunk))) > 0)
+            buf.append(chunk, n);
+        if (n == 0)
+            eof = true;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            eof = true;
+
+        size_t newline = buf.find('\n');
+        if (newline == std::string::npos && !eof && buf.size() < MAX_LINE)
+            return; // 行の続きを待つ
+
+        std::string line = buf.substr(0, std::min(newline, MAX_LINE));
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        std::string reply;
+        if (line.compare(0, 4, "GET ") == 0)
+        {
+            // "GET /metrics HTTP/1.1" → コマンド "metrics"
+            size_t begin = line.find('/', 4);
+            size_t end = line.find(' ', begin == std::string::npos ? 4 : begin);
+            std::string command = begin == std::string::npos ? "" : line.substr(begin + 1, end - begin - 1);
+            std::string body = handler(command.empty() ? "metrics" : command);
+            reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\n\r\n" + body;
+        }
+        else
+        {
+            reply = handler(line);
+        }
+        // 応答は数KBなのでソケットのバッファに収まる。書ききれなければ捨てる
+        if (write(client, reply.data(), reply.size()) < 0)
+            fprintf(stderr, "control: couldn't reply: %s\n", strerror(errno));
+
+        events.remove(client);
+        close(client);
+        clients_.erase(client);
+    }
+
+    void close_all()
+    {
+        for (auto &entry : clients_)
+            close(entry.first);
+        clients_.clear();
+        if (listen_fd_ >= 0)
+        {
+            close(listen_fd_);
+            unlink(path_.c_str());
+        }
+        listen_fd_ = -1;
+    }
+
+    int listen_fd_ = -1;
+    std::string path_;
+    std::map<int, std::string> clients_; // fd → 受け取り途中の行
+};
+
+// --- 生存確認 ---
+// 監視側 (information_board.py) が読む共有メモリ。ループが回るたびに時刻を書き、
+// 次に書く予定の時刻を過ぎても更新されなければハングとみなされる。
+// 配置はリトルエンディアン固定で、監視側の struct.unpack と対応する
+struct HeartbeatPage
+{
+    uint32_t magic;              // HEARTBEAT_MAGIC
+    uint32_t version;            // HEARTBEAT_VERSION
+    std::atomic<uint32_t> seq;   // 奇数の間は書き込み中 (32bit 機でも64bit値をずれずに読めるように)
+    uint32_t pid;                // 描画プロセスの pid (ハング時に監視側が止める)
+    uint64_t beat_ns;            // 最後に書いた時刻 (CLOCK_MONOTONIC)
+    uint64_t expect_by_ns;       // 次に書く予定の時刻 (CLOCK_MONOTONIC)
+    uint64_t frames;             // 表示したフレーム数
+};
+const uint32_t HEARTBEAT_MAGIC = 0x42484d44; // "DMHB"
+const uint32_t HEARTBEAT_VERSION = 1;
+
+class Heartbeat
+{
+public:
+    ~Heartbeat() { close_page(); }
+
+    // 権限を手放す前に作る。失敗しても表示は続ける
+    // (information_board.py は最初の生存確認が届くまでハングの判定をしないので、止められない)
+    bool open(const std::string &name)
+    {
+        close_page();
+        if (name.empty())
+            return false;
+        name_ = "/" + name;
+        int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(HeartbeatPage)) != 0)
+        {
+            fprintf(stderr, "Couldn't create heartbeat '%s': %s\n", name_.c_str(), strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, sizeof(HeartbeatPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED)
+        {
+            fprintf(stderr, "Couldn't map heartbeat '%s': %s\n", name_.c_str(), strerror(errno));
+            return false;
+        }
+        page_ = static_cast<HeartbeatPage *>(mem);
+        page_->seq.store(page_->seq.load() | 1);
+        page_->magic = HEARTBEAT_MAGIC;
+        page_->version = HEARTBEAT_VERSION;
+        page_->pid = static_cast<uint32_t>(getpid());
+        page_->frames = 0;
+        page_->seq.fetch_add(1);
+        return true;
+    }
+
+    void beat(std::chrono::steady_clock::time_point expect_by, uint64_t frames)
+    {
+        if (page_ == nullptr)
+            return;
+        auto ns = [](std::chrono::steady_clock::time_point t) {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count());
+        };
+        page_->seq.fetch_add(1); // 奇数: 書き込み中
+        page_->beat_ns = ns(std::chrono::steady_clock::now());
+        page_->expect_by_ns = ns(expect_by);
+        page_->frames = frames;
+        page_->seq.fetch_add(1);
+    }
+
+private:
+    void close_page()
+    {
+        if (page_ == nullptr)
+            return;
+        munmap(page_, sizeof(HeartbeatPage));
+        page_ = nullptr;
+        shm_unlink(name_.c_str()); // 正常終了時だけ消える (権限を手放していれば残るが、次の起動で使い回す)
+    }
+
+    HeartbeatPage *page_ = nullptr;
+    std::string name_;
+};
+
+// 統計を Prometheus のテキスト形式で書き出す
+void write_histogram(std::ostringstream &out, const char *name, const char *help, const Histogram &h)
+{
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+    unsigned long cumulative = 0;
+    for (size_t i = 0; i <= h.bounds.size(); ++i)
+    {
+        cumulative += h.counts[i].load();
+        out << name << "_bucket{le=\"";
+        if (i < h.bounds.size())
+            out << h.bounds[i];
+        else
+            out << "+Inf";
+        out << "\"} " << cumulative << "\n";
+    }
+    out << name << "_sum " << h.sum_ns.load() / 1e9 << "\n";
+    out << name << "_count " << cumulative << "\n";
+}
+
+std::string format_metrics(const TickerScheduler &ticker, const InputLoader &loader, bool night_mode)
+{
+    std::ostringstream out;
+    auto counter = [&](const char *name, const char *help, unsigned long value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n"
+            << name << " " << value << "\n";
+    };
+    auto gauge_header = [&](const char *name, const char *help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n";
+    };
+
+    write_histogram(out, "draw_matrix_frame_seconds", "Time to draw and swap one frame.", metrics.frame_time);
+    counter("draw_matrix_dropped_frames_total", "Scroll frames that missed their deadline.", metrics.dropped_frames);
+    write_histogram(out, "draw_matrix_load_seconds", "Time for one loader pass over all input files.", metrics.load_time);
+    counter("draw_matrix_input_checks_total", "Input file checks.", metrics.reloads);
+    counter("draw_matrix_input_parsed_total", "Input files parsed because their content changed.", metrics.reloads_parsed);
+    out << "# HELP draw_matrix_input_skipped_total Input file checks that skipped parsing.\n"
+        << "# TYPE draw_matrix_input_skipped_total counter\n"
+        << "draw_matrix_input_skipped_total{reason=\"stat\"} " << metrics.reloads_skipped_stat.load() << "\n"
+        << "draw_matrix_input_skipped_total{reason=\"hash\"} " << metrics.reloads_skipped_hash.load() << "\n";
+    counter("draw_matrix_parse_errors_total", "Input files that failed to parse.", metrics.parse_errors);
+    counter("draw_matrix_ticker_rebuilds_total", "Ticker message list rebuilds.", metrics.ticker_rebuilds);
+    counter("draw_matrix_unknown_types_total", "Train types without a known colour.", metrics.unknown_types);
+
+    gauge_header("draw_matrix_ticker_messages", "Messages in the ticker queue.");
+    static const char *const priority_names[] = {"info", "notice", "urgent"};
+    int per_priority[3] = {};
+    for (const TickerMessage &msg : ticker.messages)
+    {
+        if (!msg.removed)
+            per_priority[std::clamp(msg.priority, 0, 2)]++;
+    }
+    for (int p = 0; p < 3; ++p)
+        out << "draw_matrix_ticker_messages{priority=\"" << priority_names[p] << "\"} " << per_priority[p] << "\n";
+
+    gauge_header("draw_matrix_input_age_seconds", "Seconds since each input file was last written.");
+    static const char *const input_names[] = {"departure", "operation", "weather", "first_last_train"};
+    std::time_t t_now = std::time(nullptr);
+    for (int k = 0; k < LoadedInputs::COUNT; ++k)
+    {
+        std::time_t mtime = loader.input_mtime(k);
+        if (mtime != 0)
+            out << "draw_matrix_input_age_seconds{input=\"" << input_names[k] << "\"} " << t_now - mtime << "\n";
+    }
+
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr)
+    {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    gauge_header("draw_matrix_resident_memory_bytes", "Resident set size.");
+    out << "draw_matrix_resident_memory_bytes " << resident * sysconf(_SC_PAGESIZE) << "\n";
+    gauge_header("draw_matrix_input_arena_bytes", "Memory mapped for the parsed input files.");
+    out << "draw_matrix_input_arena_bytes " << JsonArena::mapped_bytes().load() << "\n";
+    gauge_header("draw_matrix_brightness", "Panel brightness (percent).");
+    out << "draw_matrix_brightness " << config.matrix.brightness << "\n";
+    gauge_header("draw_matrix_night_mode", "1 while the night mode is active.");
+    out << "draw_matrix_night_mode " << (night_mode ? 1 : 0) << "\n";
+    return out.str();
+}
+
+// 各レイヤーの最後の更新時刻
+struct FrameTimers
+{
+    std::chrono::steady_clock::time_point last_toggle;
+    std::chrono::steady_clock::time_point last_page;
+};
+
+// 現在のレイヤー構成で次に描画が必要になる時刻
+std::chrono::steady_clock::time_point next_frame_deadline(unsigned layers,
+                                                          std::chrono::steady_clock::time_point now,
+                                                          const FrameTimers &timers)
+{
+    using namespace std::chrono;
+
+    // データ読み込みは InputLoader のスレッドが行い、届いたら待ちを打ち切って起こす
+    steady_clock::time_point deadline = steady_clock::time_point::max();
+
+    if (layers & LAYER_TICKER)
+        deadline = std::min(deadline, now + milliseconds(config.scroll_frame_ms));
+
+    if (layers & LAYER_MARQUEE)
+        deadline = std::min(deadline, now + milliseconds(config.marquee_step_ms));
+
+    if (layers & LAYER_FACE)
+        deadline = std::min(deadline, timers.last_toggle + seconds(config.toggle_seconds));
+
+    if (layers & LAYER_PAGE)
+        deadline = std::min(deadline, timers.last_page + seconds(config.page_seconds));
+
+    if (layers & LAYER_COLON)
+    {
+        // 壁時計の次の秒境界 (分表示の更新もここに含まれる)
+        auto since_epoch = system_clock::now().time_since_epoch();
+        auto to_next_sec = milliseconds(1000) - duration_cast<milliseconds>(since_epoch) % 1000;
+        deadline = std::min(deadline, now + to_next_sec);
+    }
+    return deadline;
+}
+
+// --- レイアウト ---
+// キャンバスの大きさとフォントから各領域の位置を求める。
+// 下端の1行をスクロールメッセージと時計、残りの行を発車情報に使う。
+// パネル構成・フォントが変わったときだけ計算し直す。
+struct Layout
+{
+    int width = 0;
+    int height = 0;
+    int line_height = 0;
+
+    std::vector<int> row_baselines; // 発車情報の各行のベースラインY座標
+    std::vector<int> separator_ys;  // 各行の下の区切り線 (フォントのはみ出しを消す)
+
+    // A面: [方面][残り時間][行先]  B面: [種別][発車時刻][行先]
+    int direction_x = 0;
+    int time_x = 0;
+    int type_x = 0;
+    int dep_time_x = 0;
+    int dest_x = 0;
+
+    // 最下段: スクロールメッセージ + 右端に時計
+    int ticker_top = 0;
+    int ticker_baseline = 0;
+    int clock_x = 0;
+    int ticker_width = 0; // 時計の左までのメッセージ表示幅
+
+    int rows() const { return static_cast<int>(row_baselines.size()); }
+};
+
+Layout compute_layout(int width, int height, const DisplayFont &font)
+{
+    Layout l;
+    l.width = width;
+    l.height = height;
+    // フォントの基準線が 0 以下 (FONTBOUNDINGBOX のない BDF など) でも割り算できるように 1 以上にする
+    l.line_height = std::max(1, config.line_height > 0 ? config.line_height : font.baseline());
+
+    // 最下段の下端がパネル下端に合うように行を詰める (128x32 では 9, 20 / 31)
+    int lines = std::max(2, (height + 1) / l.line_height);
+    for (int i = 0; i < lines - 1; ++i)
+    {
+        int baseline = (i + 1) * l.line_height - 2;
+        l.row_baselines.push_back(baseline);
+        l.separator_ys.push_back(baseline + 1);
+    }
+    l.ticker_baseline = height - 1;
+    l.ticker_top = l.ticker_baseline - l.line_height + 2;
+
+    // 最下段の上にもはみ出しを消す線を引く (行と最下段の間に隙間がある場合)
+    if (l.separator_ys.empty() || l.separator_ys.back() != l.ticker_top - 1)
+        l.separator_ys.push_back(l.ticker_top - 1);
+
+    // 桁の幅はフォントで実測する。HH:MM は末尾の字間1pxを除いた幅
+    int wide = std::max(1, font.CharacterWidth(0x3042)); // 全角1文字 (あ)
+    int clock_w = measure_text(font, "00:00") - 1;
+    int minutes_w = measure_text(font, "99分後") + 1;
+
+    // 行先は全角5文字、パネルが広ければ増えた幅の半分を行先、残りを方面/種別に割り当てる
+    int dest_w = 5 * wide + std::max(0, width - 128) / 2;
+    l.dest_x = width - dest_w;
+    l.time_x = l.dest_x - minutes_w;
+    l.dep_time_x = l.dest_x - clock_w;
+    l.direction_x = 0;
+    l.type_x = 0;
+
+    l.clock_x = width - clock_w;
+    l.ticker_width = l.clock_x - 1;
+    return l;
+}
+
+// --- オフスクリーン描画 ---
+// 事前に描いておき、フレームごとにはコピーするだけにするためのキャンバス
+class PixelBuffer : public rgb_matrix::Canvas
+{
+public:
+    PixelBuffer(int width = 0, int height = 0) { resize(width, height); }
+
+    void resize(int width, int height)
+    {
+        width_ = width;
+        height_ = height;
+        pixels_.assign(static_cast<size_t>(width) * height, COL_BLACK);
+    }
+
+    // 後の resize で確保し直さないように領域だけ取っておく
+    void reserve(int width, int height) { pixels_.reserve(static_cast<size_t>(width) * height); }
+
+    int width() const override { return width_; }
+    int height() const override { return height_; }
+
+    const ColorRGB &at(int x, int y) const { return pixels_[static_cast<size_t>(y) * width_ + x]; }
+
+    void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) override
+    {
+        if (x < 0 || y < 0 || x >= width_ || y >= height_)
+            return;
+        pixels_[static_cast<size_t>(y) * width_ + x] = ColorRGB{red, green, blue};
+    }
+
+    void Clear() override { Fill(0, 0, 0); }
+
+    void Fill(uint8_t red, uint8_t green, uint8_t blue) override
+    {
+        std::fill(pixels_.begin(), pixels_.end(), ColorRGB{red, green, blue});
+    }
 
-Color ToMatrixColor(const ColorRGB &c)
-{
-    return Color(c.r, c.g, c.b);
-}
+    // 左上を (dst_x, dst_y) に合わせて dst へコピーする
+    void blit(rgb_matrix::Canvas *dst, int dst_x, int dst_y) const
+    {
+        const ColorRGB *p = pixels_.data();
+        for (int y = 0; y < height_; ++y)
+        {
+            for (int x = 0; x < width_; ++x, ++p)
+                dst->SetPixel(dst_x + x, dst_y + y, p->r, p->g, p->b);
+        }
+    }
 
-// データ保持用構造体
-struct DisplayData
+    // 横 src_x から幅 w だけを切り出して dst へコピーする
+    void blit_columns(rgb_matrix::Canvas *dst, int dst_x, int dst_y, int src_x, int w) const
+    {
+        int x0 = std::max(0, src_x);
+        int x1 = std::min(width_, src_x + w);
+        for (int y = 0; y < height_; ++y)
+        {
+            const ColorRGB *p = pixels_.data() + static_cast<size_t>(y) * width_;
+            for (int x = x0; x < x1; ++x)
+                dst->SetPixel(dst_x + x - src_x, dst_y + y, p[x].r, p[x].g, p[x].b);
+        }
+    }
+
+private:
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<ColorRGB> pixels_;
+};
+
+// 行内の1項目。x から width の範囲に収める
+struct RowCell
 {
-    json departure;
-    json operation;
-    json weather;
-    std::vector<std::string> scroll_messages;
-    std::vector<ColorRGB> scroll_colors;
+    int x = 0;
+    int width = 0;
+    ColorRGB color = COL_WHITE;
+    const char *text = ""; // DepartureRow の文字列か静的な文字列を指す
 };
 
-// JSON読み込みヘルパー
-json load_json(const std::string &path)
+const int ROW_CELLS = 3;
+
+// 発車情報の1行を項目に分ける (A面: 方面/残り時間/行先, B面: 種別/発車時刻/行先)。
+// cells に書き込んだ数を返す
+int departure_cells(const Layout &layout, const DepartureRow &row, bool alternate, std::time_t t_now,
+                    RowCell (&cells)[ROW_CELLS])
 {
-    std::ifstream i(path);
-    if (!i.is_open())
-        return nullptr;
-    try
+    if (!row.valid)
+        return 0;
+
+    if (alternate)
     {
-        json j;
-        i >> j;
-        return j;
+        // B面
+        cells[0] = {layout.type_x, layout.dep_time_x - layout.type_x, row.type_color, row.line_type.c_str()};
+        cells[1] = {layout.dep_time_x, layout.dest_x - layout.dep_time_x, COL_GREEN, row.dep_time.c_str()};
+        cells[2] = {layout.dest_x, layout.width - layout.dest_x, COL_ORANGE, row.destination.c_str()};
+        return ROW_CELLS;
     }
-    catch (...)
+
+    // A面
+    ColorRGB time_col;
+    const char *time_text = departure_countdown(row, t_now, time_col);
+
+    const char *dest_text = row.destination.c_str();
+    ColorRGB dest_col = COL_ORANGE;
+
+    if (same_color(time_col, COL_RED))
     {
-        return nullptr;
+        dest_text = "駅まで走れ";
+        dest_col = COL_RED;
     }
+    else if (same_color(time_col, COL_YELLOW))
+    {
+        dest_text = "今すぐ出発";
+        dest_col = COL_YELLOW;
+    }
+
+    cells[0] = {layout.direction_x, layout.time_x - layout.direction_x, COL_WHITE, row.direction.c_str()};
+    cells[1] = {layout.time_x, layout.dest_x - layout.time_x, time_col, time_text};
+    cells[2] = {layout.dest_x, layout.width - layout.dest_x, dest_col, dest_text};
+    return ROW_CELLS;
 }
 
-// スクロールメッセージの構築
-void update_scroll_messages(DisplayData &data)
+const long MARQUEE_HOLD_MS = 1500; // 往復スクロールが両端で止まる時間
+
+// 枠に収まらない項目。文字列全体を横長の帯に描いておき、表示時は枠の幅だけ切り出す
+struct Marquee
 {
-    data.scroll_messages.clear();
-    data.scroll_colors.clear();
+    int face = 0;  // PageCache::faces の添字
+    int x = 0;     // 枠の左端
+    int y = 0;     // 帯の上端
+    int width = 0; // 枠の幅
+    PixelBuffer strip;
 
-    // ★★★ 追加: 日付メッセージ ★★★
+    // 両端で止まりながら往復する。elapsed_ms は面が表示されてからの時間
+    int offset(long elapsed_ms) const
     {
-        std::time_t t_now = std::time(nullptr);
-        std::tm *tm_now = std::localtime(&t_now);
-        const char *wday_name[] = {"日", "月", "火", "水", "木", "金", "土"};
+        long travel = strip.width() - width;
+        if (travel <= 0)
+            return 0;
+        long step = config.marquee_step_ms;
+        long cycle = 2 * (MARQUEE_HOLD_MS + travel * step);
+        long t = elapsed_ms % cycle;
+        if (t < MARQUEE_HOLD_MS)
+            return 0;
+        t -= MARQUEE_HOLD_MS;
+        if (t < travel * step)
+            return static_cast<int>(t / step);
+        t -= travel * step;
+        if (t < MARQUEE_HOLD_MS)
+            return static_cast<int>(travel);
+        t -= MARQUEE_HOLD_MS;
+        return static_cast<int>(travel - t / step);
+    }
+};
 
-        char date_buf[64];
-        // "本日は MM月DD日（{曜日}）です" の形式を作成
-        std::sprintf(date_buf, "本日は %02d月%02d日（%s）です",
-                     tm_now->tm_mon + 1,
-                     tm_now->tm_mday,
-                     wday_name[tm_now->tm_wday]);
+struct PageCache
+{
+    std::vector<PixelBuffer> faces; // faces[page * 2 + (B面なら1)]
+    std::vector<Marquee> marquees;  // 枠に収まらない項目 (全ページ分)。帯を使い回すため縮めない
+    size_t marquee_count = 0;       // marquees のうち使っている数
+    int pages = 1;
+    long minute = -1; // 描いたときの分
+    bool stale = true;
+
+    static int face_index(int page, bool alternate) { return page * 2 + (alternate ? 1 : 0); }
+
+    const PixelBuffer &face(int page, bool alternate) const
+    {
+        return faces[face_index(page, alternate)];
+    }
 
-        data.scroll_messages.push_back(std::string(date_buf));
-        data.scroll_colors.push_back(COL_WHITE); // 白で表示
+    bool has_marquee(int page, bool alternate) const
+    {
+        int index = face_index(page, alternate);
+        return std::any_of(marquees.begin(), marquees.begin() + marquee_count,
+                           [index](const Marquee &m) { return m.face == index; });
     }
 
-    // 1. 運行情報 (見合わせ・遅延)
-    if (!data.operation.is_null())
+    // 面の静止部分に枠内の切り出しを重ねる
+    void draw_marquees(rgb_matrix::Canvas *canvas, int page, bool alternate, long elapsed_ms) const
     {
-        // (見合わせ)
-        if (data.operation.contains("suspend") && data.operation["suspend"].is_array())
+        int index = face_index(page, alternate);
+        for (size_t i = 0; i < marquee_count; ++i)
         {
-            for (const auto &item : data.operation["suspend"])
-            {
-                std::string name = item.value("name", "");
-                std::string detail = item.value("detail", "詳細不明");
-                data.scroll_messages.push_back("【運転見合わせ】 " + name + ": " + detail);
-                data.scroll_colors.push_back(COL_RED);
-            }
+            const Marquee &m = marquees[i];
+            if (m.face == index)
+                m.strip.blit_columns(canvas, m.x, m.y, m.offset(elapsed_ms), m.width);
         }
-        // (遅延)
-        if (data.operation.contains("delay") && data.operation["delay"].is_array())
+    }
+};
+
+void render_pages(PageCache &cache, const std::vector<DepartureRow> &rows, const Layout &layout,
+                  const DisplayFont &font, std::time_t t_now)
+{
+    int per_page = std::max(1, layout.rows());
+    cache.pages = std::max(1, static_cast<int>((rows.size() + per_page - 1) / per_page));
+    cache.faces.resize(cache.pages * 2);
+    cache.marquee_count = 0;
+
+    for (int page = 0; page < cache.pages; ++page)
+    {
+        for (int alt = 0; alt < 2; ++alt)
         {
-            for (const auto &item : data.operation["delay"])
+            PixelBuffer &buf = cache.faces[page * 2 + alt];
+            buf.resize(layout.width, layout.ticker_top);
+            for (int i = 0; i < per_page; ++i)
             {
-                std::string name = item.value("name", "");
-                std::string detail = item.value("detail", "詳細不明");
-                data.scroll_messages.push_back("【遅延】 " + name + ": " + detail);
-                data.scroll_colors.push_back(COL_YELLOW);
+                size_t index = static_cast<size_t>(page) * per_page + i;
+                if (index >= rows.size())
+                    break;
+                int baseline = layout.row_baselines[i];
+                int top = (i == 0) ? 0 : layout.separator_ys[i - 1] + 1;
+
+                RowCell cells[ROW_CELLS];
+                int count = departure_cells(layout, rows[index], alt == 1, t_now, cells);
+                for (int c = 0; c < count; ++c)
+                {
+                    const RowCell &cell = cells[c];
+                    int text_w = measure_text(font, cell.text);
+                    if (text_w <= cell.width)
+                    {
+                        draw_text(&buf, font, cell.x, baseline, ToMatrixColor(cell.color), cell.text);
+                        continue;
+                    }
+
+                    // 収まらない項目は帯に描いておき、毎フレームは切り出してコピーするだけにする。
+                    // 帯は前回の描画のものを使い回す (毎分の描き直しで確保し直さない)
+                    if (cache.marquee_count == cache.marquees.size())
+                        cache.marquees.emplace_back();
+                    Marquee &m = cache.marquees[cache.marquee_count++];
+                    m.face = page * 2 + alt;
+                    m.x = cell.x;
+                    m.y = top;
+                    m.width = cell.width;
+                    m.strip.resize(text_w, baseline - top + 1);
+                    draw_text(&m.strip, font, 0, baseline - top, ToMatrixColor(cell.color), cell.text);
+                }
             }
         }
     }
+    cache.minute = static_cast<long>(t_now / 60);
+    cache.stale = false;
+}
 
-    // 2. 天気予報
-    if (!data.weather.is_null())
+// 連続表示 (リボン) のメッセージ帯。
+// 帯の各列をリングバッファに持ち、フレームごとに先頭を1列ずらして右端に新しい1列だけを書き足す。
+// 書き足す列は、流し始めるときに一度だけ描いた素材 (メッセージまたは区切り) から取る
+class TickerRibbon
+{
+public:
+    void reset(int width, int height)
     {
-        try
+        width_ = std::max(1, width);
+        height_ = std::max(1, height);
+        head_ = 0;
+        columns_.assign(static_cast<size_t>(width_) * height_, COL_BLACK);
+        column_blink_.assign(width_, 0);
+        source_.resize(0, height_);
+        source_.reserve(reserved_, height_);
+        source_blink_.clear();
+        source_x_ = 0;
+        in_message_ = false;
+    }
+
+    bool fits(int width, int height) const { return width_ == std::max(1, width) && height_ == std::max(1, height); }
+
+    // 流す素材の最大幅。メッセージを作り直したときに取っておき、流している間は確保しない
+    void reserve(int width)
+    {
+        reserved_ = std::max(reserved_, width);
+        source_.reserve(reserved_, height_);
+        source_blink_.reserve(reserved_);
+    }
+
+    bool source_done() const { return source_x_ >= source_.width(); }
+    bool in_message() const { return in_message_; }
+    int fed() const { return source_x_; } // 素材のうち帯に入った幅
+
+    // 次に流す素材を描く (baseline は帯の上端から)
+    void load(const DisplayFont &font, const GlyphRun &run, const SpanBuffer &spans, const ColorRGB &color,
+              int baseline, bool message)
+    {
+        source_.resize(run.width(), height_);
+        draw_run_clipped(&source_, font, run, spans, 0, baseline, ToMatrixColor(color), 0, run.width());
+
+        // 点滅する文字の列に印を付けておき、消灯側のフレームではその列を描かない
+        source_blink_.assign(run.width(), 0);
+        for (const TextSpan *span = spans.begin(run.spans); span != spans.end(run.spans); ++span)
         {
-            std::string area = data.weather.value("area_name", "不明");
-            std::string weather = data.weather.value("weather", "不明");
-            std::string office = data.weather.value("publishing_office", " 気象庁");
-            std::string report_time = data.weather.value("report_time", " ");
-            data.scroll_messages.push_back("【" + office + " " + report_time + "発表】" + area + "の天気: " + weather);
-            data.scroll_colors.push_back(COL_WHITE);
+            if (span->style & STYLE_BLINK)
+                std::fill(source_blink_.begin() + run.offsets[span->first],
+                          source_blink_.begin() + run.offsets[span->first + span->count], 1);
         }
-        catch (...)
+        source_x_ = 0;
+        in_message_ = message;
+    }
+
+    // 素材の残りを流さずに打ち切る
+    void cut() { source_x_ = source_.width(); }
+
+    // いちばん左の列を捨て、素材の次の列 (なければ空白) を右端に足す
+    void advance()
+    {
+        ColorRGB *col = &columns_[static_cast<size_t>(head_) * height_];
+        if (source_x_ < source_.width())
         {
+            for (int y = 0; y < height_; ++y)
+                col[y] = source_.at(source_x_, y);
+            column_blink_[head_] = source_blink_[source_x_];
+            source_x_++;
         }
+        else
+        {
+            std::fill(col, col + height_, COL_BLACK);
+            column_blink_[head_] = 0;
+        }
+        head_ = (head_ + 1) % width_;
     }
 
-    // 運行終了メッセージ/エラーメッセージの追加
-    if (data.departure.is_null() || data.departure.empty())
+    void draw(rgb_matrix::Canvas *canvas, int x, int y, bool blink_on) const
+    {
+        for (int i = 0; i < width_; ++i)
+        {
+            int c = (head_ + i) % width_;
+            if (column_blink_[c] && !blink_on)
+                continue;
+            const ColorRGB *col = &columns_[static_cast<size_t>(c) * height_];
+            for (int row = 0; row < height_; ++row)
+                canvas->SetPixel(x + i, y + row, col[row].r, col[row].g, col[row].b);
+        }
+    }
+
+private:
+    int width_ = 1;
+    int height_ = 1;
+    int head_ = 0; // いちばん左に表示する列
+    std::vector<ColorRGB> columns_; // 列ごとに height_ 個ずつ
+    std::vector<uint8_t> column_blink_; // 点滅する文字の列
+    PixelBuffer source_;
+    std::vector<uint8_t> source_blink_;
+    int reserved_ = 0; // reserve() で取っておいた素材の幅
+    int source_x_ = 0;
+    bool in_message_ = false;
+};
+
+#ifdef ALLOC_CHECK
+// --- 確保の検査用ビルド (make alloc_check) ---
+// 描画スレッドが数えている間の operator new を数え、定常状態のフレームで確保が起きないことを確かめる
+namespace alloc_check
+{
+thread_local bool counting = false;
+thread_local unsigned long allocations = 0;
+thread_local size_t first_size = 0; // フレーム内で最初に確保した大きさ (原因を探す手がかり)
+}
+
+void *operator new(size_t size)
+{
+    if (alloc_check::counting && alloc_check::allocations++ == 0)
+        alloc_check::first_size = size;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+const int ALLOC_CHECK_WARMUP_FRAMES = 250; // 起動直後の素材の確保などは数えない
+const int ALLOC_CHECK_FRAMES = 3000;       // 50fps で約1分 (毎分のページの描き直しを含む)
+
+// 起きてから次に待つまでを1フレームとして数える。入力の取り込みや設定の再読み込みをした
+// フレームは定常状態ではないので除く。ALLOC_CHECK_FRAMES 数えたら結果を出して終了する
+class AllocCheck
+{
+public:
+    void begin_frame()
+    {
+        steady_ = true;
+        alloc_check::allocations = 0;
+        alloc_check::counting = true;
+    }
+
+    void skip_frame() { steady_ = false; }
+
+    // 待つ前に呼ぶ。数え終わったら true
+    bool end_frame()
     {
-        data.scroll_messages.push_back("エラーが発生しています。情報が取得できていません");
-        data.scroll_colors.push_back(COL_RED);
+        alloc_check::counting = false;
+        if (!steady_ || ++frames_ <= ALLOC_CHECK_WARMUP_FRAMES)
+            return false;
+        if (alloc_check::allocations > 0)
+        {
+            if (failed_frames_++ < 10)
+                fprintf(stderr, "alloc_check: frame %d made %lu allocation(s), first of %zu bytes\n",
+                        frames_, alloc_check::allocations, alloc_check::first_size);
+            total_ += alloc_check::allocations;
+        }
+        return frames_ - ALLOC_CHECK_WARMUP_FRAMES >= ALLOC_CHECK_FRAMES;
     }
 
-    if (data.scroll_messages.empty())
+    // 終了コード (確保があれば 1)
+    int report() const
     {
-        data.scroll_messages.push_back("平常運転");
-        data.scroll_colors.push_back(COL_GREEN);
+        fprintf(stderr, "alloc_check: %d steady frames, %lu allocation(s) in %d frame(s)\n",
+                std::max(0, frames_ - ALLOC_CHECK_WARMUP_FRAMES), total_, failed_frames_);
+        return failed_frames_ > 0 ? 1 : 0;
     }
-}
 
-// 描画切替グローバル変数
-bool show_alternate_display = false;
-auto last_toggle_time = std::chrono::steady_clock::now();
-const int TOGGLE_SECONDS = 5; // 5秒ごとに切り替え
+private:
+    bool steady_ = false;
+    int frames_ = 0;
+    int failed_frames_ = 0;
+    unsigned long total_ = 0;
+};
+#endif
 
 // メイン描画ループ
 int main(int argc, char *argv[])
 {
-    // --- Matrix設定 ---
-    RGBMatrix::Options defaults;
-    defaults.hardware_mapping = "regular";
-    defaults.rows = 32;
-    defaults.cols = 128;
-    defaults.chain_length = 1;
-    defaults.parallel = 1;
+    // --- 設定読み込み (引数で設定ファイルを指定可能) ---
+    const std::string config_path = (argc > 1) ? argv[1] : CONFIG_FILE;
+    if (!load_config(config_path, config))
+        fprintf(stderr, "Using built-in defaults (config '%s' not loaded)\n", config_path.c_str());
+    tracer.register_thread("render");
+    tracer.set_enabled(config.trace_enabled);
 
-    rgb_matrix::RuntimeOptions runtime_opt;
-    runtime_opt.gpio_slowdown = 1;
+    // --- シグナルは signalfd で受ける (他のスレッドができる前にブロックし、全スレッドに引き継がせる) ---
+    sigset_t handled_signals;
+    sigemptyset(&handled_signals);
+    for (int signo : {SIGTERM, SIGINT, SIGHUP, SIGUSR1})
+        sigaddset(&handled_signals, signo);
+    pthread_sigmask(SIG_BLOCK, &handled_signals, nullptr);
 
-    RGBMatrix *matrix = RGBMatrix::CreateFromOptions(defaults, runtime_opt);
+    // --- スレッド配置 (優先度は権限を手放す前、コアはパネル更新スレッドができた後に決める) ---
+    set_thread_priority(pthread_self(), config.render_priority, "render");
+
+    // --- 制御用ソケット (権限を手放す前に作る) ---
+    ControlServer control;
+    control.open(config.control_socket);
+    Heartbeat heartbeat;
+    heartbeat.open(config.heartbeat);
+
+    // --- Matrix設定 ---
+    RGBMatrix *matrix = create_matrix(config.matrix);
     if (matrix == NULL)
         return 1;
+    pin_thread(pthread_self(), config.render_cpu, "render");
 
     // --- フォント読み込み ---
-    rgb_matrix::Font font;
-    if (!font.LoadFont(FONT_FILE.c_str()))
+    std::unique_ptr<DisplayFont> font = load_font(config.font_file);
+    if (!font)
     {
-        fprintf(stderr, "Couldn't load font '%s'\n", FONT_FILE.c_str());
+        fprintf(stderr, "Couldn't load font '%s'\n", config.font_file.c_str());
         return 1;
     }
 
     FrameCanvas *offscreen = matrix->CreateFrameCanvas();
-    signal(SIGTERM, InterruptHandler);
-    signal(SIGINT, InterruptHandler);
+
+    // --- イベントループ ---
+    EventLoop events;
+    if (!events.ok())
+    {
+        fprintf(stderr, "Couldn't create event loop: %s\n", strerror(errno));
+        return 1;
+    }
+
+    bool interrupt_received = false;      // SIGTERM / SIGINT
+    bool config_reload_requested = false; // SIGHUP
+    bool stats_requested = false;         // SIGUSR1
+    int signal_fd = signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (!events.add(signal_fd, [&](uint32_t) {
+            TraceScope trace("signal", "ipc");
+            signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                if (info.ssi_signo == SIGHUP)
+                    config_reload_requested = true;
+                else if (info.ssi_signo == SIGUSR1)
+                    stats_requested = true;
+                else
+                    interrupt_received = true;
+            }
+        }))
+    {
+        fprintf(stderr, "Couldn't set up signalfd: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // 入力ファイルは変更通知で読む。見張れないときだけ読み込みスレッドが一定間隔で確認する
+    bool night_mode = false;
+    InputWatcher watcher;
+    auto watch_inputs = [&] {
+        watcher.watch({config.departure_file, config.operation_file, config.weather_file, config.first_last_file});
+    };
+    auto loader_interval = [&] {
+        if (watcher.active())
+            return 0;
+        return night_mode ? config.night_reload_seconds : config.reload_seconds;
+    };
+    watch_inputs();
 
     DisplayData current_data;
+    InputLoader loader;
+    loader.start(config, loader_interval());
+    events.add(loader.notify_fd(), [&](uint32_t) { loader.clear_notify(); });
+    events.add(watcher.fd(), [&](uint32_t) {
+        TraceScope trace("inotify", "ipc");
+        bool was_active = watcher.active();
+        if (watcher.drain())
+            loader.kick();
+        if (was_active && !watcher.active())
+            loader.configure(config, loader_interval());
+    });
+
+    Layout layout = compute_layout(matrix->width(), matrix->height(), *font);
 
     // スクロール管理変数
-    int scroll_x = matrix->width();
-    size_t msg_index = 0;
+    int scroll_x = layout.width;
+    TickerRibbon ribbon;
+    GlyphRun separator_run;
+    separator_run.build(*font, config.ticker_separator);
+    rebuild_line_index(current_data);
+
+    // 発車情報のページ
+    PageCache pages;
+    int page_index = 0;
 
     // データ更新タイマー
-    auto last_load_time = std::chrono::steady_clock::now();
+    FrameTimers timers;
+    timers.last_toggle = timers.last_page = std::chrono::steady_clock::now();
     bool first_run = true;
+    int loaded_yday = -1; // 日付メッセージの更新用
 
-    while (!interrupt_received)
-    {
-        auto now = std::chrono::steady_clock::now();
+    // 再描画管理 (変化がないフレームは描画・スワップしない)
+    bool dirty = true;
+    std::time_t last_drawn_time = 0;
+    bool rebuild_requested = false; // 入力が変わらなくてもメッセージを作り直す
 
-        // --- 1. データ読み込み (初回 または 2秒ごと) ---
-        if (first_run || std::chrono::duration_cast<std::chrono::seconds>(now - last_load_time).count() >= 2)
-        {
-            current_data.departure = load_json(DEPARTURE_FILE);
-            current_data.operation = load_json(OPERATION_FILE);
-            current_data.weather = load_json(WEATHER_FILE);
-            update_scroll_messages(current_data);
+    // 間に合わなかったフレームの検出用 (前回待った時刻とそのときスクロール中だったか)
+    auto waited_until = std::chrono::steady_clock::now();
+    bool waited_for_scroll = false;
 
-            last_load_time = now;
-            first_run = false;
+    // 待つ前に生存確認を書く (監視側は deadline を過ぎても次が書かれなければハングとみなす)
+    uint64_t frames_shown = 0;
+    uint64_t loop_begin_ns = 0;      // トレース用 (起きてから次に待つまで)
+    bool slow_frame_traced = false;  // 予算を超えたフレームの記録を書き出す
+    auto last_trace_dump = std::chrono::steady_clock::time_point();
+#ifdef ALLOC_CHECK
+    AllocCheck alloc_check;
+#endif
+    auto wait_until = [&](std::chrono::steady_clock::time_point deadline) {
+#ifdef ALLOC_CHECK
+        if (alloc_check.end_frame())
+            interrupt_received = true;
+#endif
+        if (loop_begin_ns != 0)
+            tracer.record("loop", "render", loop_begin_ns, trace_now_ns());
+        if (slow_frame_traced)
+        {
+            slow_frame_traced = false;
+            tracer.dump(config.trace_dir, "slow-frame");
         }
+        waited_until = deadline;
+        heartbeat.beat(deadline, frames_shown);
+        events.wait_until(deadline);
+    };
 
-        // --- 描画切替 (5秒ごと) ---
-        if (std::chrono::duration_cast<std::chrono::seconds>(now - last_toggle_time).count() >= TOGGLE_SECONDS)
+    // 制御コマンド
+    auto handle_command = [&](const std::string &line) -> std::string {
+        TraceScope trace("control", "ipc");
+        std::istringstream in(line);
+        std::string command;
+        in >> command;
+        if (command.empty() || command == "metrics")
+            return format_metrics(current_data.ticker, loader, night_mode);
+        if (command == "reload")
         {
-            show_alternate_display = !show_alternate_display;
-            last_toggle_time = now;
+            loader.reload_all();
+            return "ok\n";
         }
+        if (command == "brightness")
+        {
+            int value = 0;
+            if (!(in >> value) || value < 1 || value > 100)
+                return "error: brightness takes 1-100\n";
+            config.matrix.brightness = value;
+            matrix->SetBrightness(value);
+            dirty = true;
+            return "ok\n";
+        }
+        if (command == "message")
+        {
+            // message [秒数] 本文
+            int seconds = 60;
+            std::string text;
+            std::getline(in >> std::ws, text);
+            size_t digits = 0;
+            while (digits < text.size() && std::isdigit(static_cast<unsigned char>(text[digits])))
+                ++digits;
+            if (digits > 0 && digits < text.size() && text[digits] == ' ')
+            {
+                seconds = std::max(1, std::atoi(text.substr(0, digits).c_str()));
+                text = text.substr(digits + 1);
+            }
+            if (text.empty())
+                return "error: message needs text\n";
+            current_data.injected.push_back({text, seconds, std::chrono::steady_clock::now() + std::chrono::seconds(seconds)});
+            rebuild_requested = true;
+            return "ok\n";
+        }
+        if (command == "trace")
+        {
+            // trace: 記録を書き出す / trace on|off: 記録の開始・停止
+            std::string arg;
+            in >> arg;
+            if (arg == "on" || arg == "off")
+            {
+                tracer.set_enabled(arg == "on");
+                return "ok\n";
+            }
+            last_trace_dump = std::chrono::steady_clock::now();
+            std::string path = tracer.dump(config.trace_dir, "request");
+            if (path.empty())
+                return "error: previous trace is still being written\n";
+            return path + "\n";
+        }
+        if (command == "help")
+            return "metrics | reload | brightness <1-100> | message [seconds] <text> | trace [on|off] | help\n";
+        return "error: unknown command '" + command + "'\n";
+    };
+    auto listen_control = [&] {
+        if (control.fd() >= 0)
+            events.add(control.fd(), [&](uint32_t) { control.accept_clients(events, handle_command); });
+    };
+    listen_control();
 
-        // --- 2. 描画クリア ---
-        offscreen->Fill(0, 0, 0);
-
-        // --- 3. 発車情報描画 ---
-        int row_y_positions[] = {9, 20}; // 上段、中段のベースラインY座標
-        int current_row = 0;
+    while (!interrupt_received)
+    {
+#ifdef ALLOC_CHECK
+        alloc_check.begin_frame();
+#endif
+        auto now = std::chrono::steady_clock::now();
+        loop_begin_ns = tracer.enabled() ? trace_now_ns() : 0;
+        if (waited_for_scroll && now - waited_until >= std::chrono::milliseconds(config.scroll_frame_ms))
+            metrics.dropped_frames += (now - waited_until) / std::chrono::milliseconds(config.scroll_frame_ms);
+        waited_for_scroll = false;
 
-        if (!current_data.departure.is_null() && !current_data.departure.empty())
+        // --- 0. 設定の再読み込み (SIGHUP) ---
+        if (config_reload_requested)
         {
-            for (auto &el : current_data.departure.items())
+#ifdef ALLOC_CHECK
+            alloc_check.skip_frame();
+#endif
+            config_reload_requested = false;
+            Config next = config;
+            if (load_config(config_path, next))
             {
-                if (current_row >= 2)
-                    break;
-
-                std::string dest_name = el.key();
-                json val = el.value();
+                Config prev = config;
+                config = next;
+                fprintf(stderr, "Config reloaded from '%s'\n", config_path.c_str());
 
-                if (!val.is_null() && val.contains("segments") && !val["segments"].empty())
+                if (!prev.matrix.same_hardware(next.matrix))
                 {
-                    json seg = val["segments"][0];
-                    std::string line_type = seg.value("type", "");
-                    std::string dep_time = val.value("departure_time", "--:--");
-                    std::string destination = seg.value("destination", "");
-                    std::string status = val.value("status", "");
-
-                    // 種別色
-                    Color col_type = ToMatrixColor(COL_WHITE);
-                    for (auto const &[key, val_color] : type_color_map)
-                    {
-                        if (line_type.find(key) != std::string::npos)
-                        {
-                            col_type = ToMatrixColor(val_color);
-                            break;
-                        }
-                    }
-
-                    // 時間計算と色決定（A面用）
-                    std::string time_text = "";
-                    Color time_col = ToMatrixColor(COL_GREEN);
-
-                    if (status == "始発")
+                    if (prev.matrix.drop_privileges)
                     {
-                        time_text = "始発";
-                        time_col = ToMatrixColor(COL_BLUE);
-                    }
-                    else if (status == "終電")
-                    {
-                        time_text = "終電";
-                        time_col = ToMatrixColor(COL_RED);
+                        // 権限を手放した後は GPIO を初期化し直せないため、構成変更は次回起動時に反映
+                        fprintf(stderr, "Matrix geometry/refresh changes need a restart (drop_privileges is on)\n");
+                        MatrixConfig live = prev.matrix;
+                        live.brightness = next.matrix.brightness;
+                        live.pwm_bits = next.matrix.pwm_bits;
+                        config.matrix = live;
                     }
                     else
                     {
-                        std::time_t t_now_calc = std::time(nullptr);
-                        std::tm tm_now_calc = *std::localtime(&t_now_calc);
-                        std::tm tm_dep = tm_now_calc;
-
-                        int dep_hour, dep_min;
-                        if (sscanf(dep_time.c_str(), "%d:%d", &dep_hour, &dep_min) == 2)
-                        {
-                            tm_dep.tm_hour = dep_hour;
-                            tm_dep.tm_min = dep_min;
-                            tm_dep.tm_sec = 0;
-
-                            if (dep_hour < 3 && tm_now_calc.tm_hour >= 3)
-                            {
-                                tm_dep.tm_mday += 1;
-                            }
-
-                            std::time_t t_dep = std::mktime(&tm_dep);
-                            double diff_seconds = std::difftime(t_dep, t_now_calc);
-                            int diff_minutes = static_cast<int>(diff_seconds / 60.0) + 1;
-
-                            if (diff_minutes > 99)
-                            {
-                                time_text = "始発";
-                                time_col = ToMatrixColor(COL_BLUE);
-                            }
-                            else
-                            {
-                                time_text = std::to_string(diff_minutes) + "分後";
-                                if (diff_minutes <= 17)
-                                    time_col = ToMatrixColor(COL_RED);
-                                else if (diff_minutes <= 20)
-                                    time_col = ToMatrixColor(COL_YELLOW);
-                                else
-                                    time_col = ToMatrixColor(COL_GREEN);
-                            }
-                        }
-                        else
+                        delete matrix;
+                        matrix = create_matrix(config.matrix);
+                        if (matrix == NULL)
                         {
-                            time_text = "--:--";
+                            fprintf(stderr, "Couldn't recreate matrix with new options\n");
+                            return 1;
                         }
+                        offscreen = matrix->CreateFrameCanvas();
+                        scroll_x = matrix->width();
                     }
+                }
+                if (prev.render_cpu != config.render_cpu)
+                    pin_thread(pthread_self(), config.render_cpu, "render");
+                if (prev.render_priority != config.render_priority)
+                    set_thread_priority(pthread_self(), config.render_priority, "render"); // 上げるのは権限を手放す前だけ
+                matrix->SetBrightness(config.matrix.brightness);
+                matrix->SetPWMBits(config.matrix.pwm_bits);
 
-                    // 表示切替ロジック
-                    if (show_alternate_display)
+                // フォントはパスが変わったときだけ読み直す (失敗したら元のフォントを使い続ける)
+                if (prev.font_file != config.font_file)
+                {
+                    std::unique_ptr<DisplayFont> next_font = load_font(config.font_file);
+                    if (next_font)
                     {
-                        // B面
-                        rgb_matrix::DrawText(offscreen, font, 0, row_y_positions[current_row],
-                                             col_type, NULL, line_type.c_str(), 0);
-                        rgb_matrix::DrawText(offscreen, font, 50, row_y_positions[current_row],
-                                             ToMatrixColor(COL_GREEN), NULL, dep_time.c_str(), 0);
-                        rgb_matrix::DrawText(offscreen, font, matrix->width() - 50, row_y_positions[current_row],
-                                             ToMatrixColor(COL_ORANGE), NULL, destination.c_str(), 0);
+                        font = std::move(next_font);
+                        current_data.ticker = TickerScheduler(); // 描画幅を測り直す
+                        scroll_x = matrix->width();
                     }
                     else
                     {
-                        // A面
-                        std::string direction_text = dest_name + "方面";
-                        rgb_matrix::DrawText(offscreen, font, 0, row_y_positions[current_row],
-                                             ToMatrixColor(COL_WHITE), NULL, direction_text.c_str(), 0);
+                        fprintf(stderr, "Couldn't load font '%s', keeping '%s'\n",
+                                config.font_file.c_str(), prev.font_file.c_str());
+                        config.font_file = prev.font_file;
+                    }
+                }
 
-                        rgb_matrix::DrawText(offscreen, font, 45, row_y_positions[current_row],
-                                             time_col, NULL, time_text.c_str(), 0);
+                layout = compute_layout(matrix->width(), matrix->height(), *font);
+                separator_run.build(*font, config.ticker_separator);
+                rebuild_line_index(current_data);
+                pages.stale = true;
+                watch_inputs();
+                loader.configure(config, loader_interval());
+                if (prev.control_socket != config.control_socket)
+                {
+                    // 権限を手放した後は置けない場所もある (失敗したらソケットなしで続ける)
+                    if (control.fd() >= 0)
+                        events.remove(control.fd());
+                    control.open(config.control_socket);
+                    listen_control();
+                }
+                if (prev.heartbeat != config.heartbeat)
+                    heartbeat.open(config.heartbeat);
+                if (prev.trace_enabled != config.trace_enabled)
+                    tracer.set_enabled(config.trace_enabled);
+                current_data.board = DepartureBoard(); // 固定行の設定を反映し直す
+                first_run = true; // 手元の入力から作り直す
+                dirty = true;
+            }
+        }
 
-                        std::string dest_text = destination;
-                        Color dest_col = ToMatrixColor(COL_ORANGE);
+        // --- 1. 読み込みスレッドが解析した入力の取り込み (初回・設定変更時は手元の入力から作り直す) ---
+        LoadedInputs inputs;
+        if (loader.take(inputs) || first_run || rebuild_requested)
+        {
+#ifdef ALLOC_CHECK
+            alloc_check.skip_frame();
+#endif
+            TraceScope trace("apply_inputs", "render");
+            // 内容が変わった入力だけ反映し、何も変わらなければ後段の処理もすべて省く
+            bool changed = false;
+            if (inputs.changed[LoadedInputs::DEPARTURE] || first_run)
+            {
+                if (inputs.changed[LoadedInputs::DEPARTURE])
+                    current_data.departure = std::move(inputs.values[LoadedInputs::DEPARTURE]);
+                if (update_departure_board(current_data.board, current_data.departure.doc, std::time(nullptr)))
+                    pages.stale = true;
+                changed = true;
 
-                        if (time_col.r == COL_RED.r && time_col.g == COL_RED.g && time_col.b == COL_RED.b)
-                        {
-                            dest_text = "駅まで走れ";
-                            dest_col = ToMatrixColor(COL_RED);
-                        }
-                        else if (time_col.r == COL_YELLOW.r && time_col.g == COL_YELLOW.g && time_col.b == COL_YELLOW.b)
-                        {
-                            dest_text = "今すぐ出発";
-                            dest_col = ToMatrixColor(COL_YELLOW);
-                        }
+                // 路線が変わったときだけ強調表示のオートマトンを作り直す
+                std::vector<std::string> lines = departure_lines(current_data.departure.doc);
+                if (lines != current_data.route_lines)
+                {
+                    current_data.route_lines = std::move(lines);
+                    rebuild_line_index(current_data);
+                }
+            }
+            if (inputs.changed[LoadedInputs::OPERATION])
+            {
+                current_data.operation = std::move(inputs.values[LoadedInputs::OPERATION]);
+                changed = true;
+            }
+            if (inputs.changed[LoadedInputs::WEATHER])
+            {
+                current_data.weather = std::move(inputs.values[LoadedInputs::WEATHER]);
+                changed = true;
+            }
+            if (inputs.changed[LoadedInputs::FIRST_LAST])
+            {
+                current_data.first_last = std::move(inputs.values[LoadedInputs::FIRST_LAST]);
+                current_data.service = parse_service_hours(current_data.first_last.doc);
+            }
 
-                        rgb_matrix::DrawText(offscreen, font, matrix->width() - 50, row_y_positions[current_row],
-                                             dest_col, NULL, dest_text.c_str(), 0);
-                    }
+            // 日付が変わったら日付メッセージを作り直す
+            std::time_t t_load = std::time(nullptr);
+            int yday = std::localtime(&t_load)->tm_yday;
+
+            if (first_run || changed || yday != loaded_yday || rebuild_requested)
+            {
+                update_scroll_messages(current_data, *font);
+                metrics.ticker_rebuilds++;
+                int widest = separator_run.width();
+                for (const TickerMessage &msg : current_data.ticker.messages)
+                    widest = std::max(widest, msg.width);
+                ribbon.reserve(widest);
+                loaded_yday = yday;
+                dirty = true;
+            }
+
+            first_run = false;
+            rebuild_requested = false;
+        }
+
+        if (stats_requested)
+        {
+#ifdef ALLOC_CHECK
+            alloc_check.skip_frame();
+#endif
+            stats_requested = false;
+            print_metrics(metrics);
+        }
+
+        // --- 夜間モード (終電後は最小限の静止画面で待機し、始発前に復帰) ---
+        std::time_t t_frame = std::time(nullptr);
+        std::tm tm_frame = *std::localtime(&t_frame);
+        bool night = is_night_time(current_data.service, tm_frame);
+        if (night != night_mode)
+        {
+            night_mode = night;
+            fprintf(stderr, night_mode ? "Entering night mode.\n" : "Leaving night mode.\n");
+            scroll_x = layout.width;
+            current_data.ticker.finish_current();
+            last_drawn_time = 0;
+            dirty = true;
+            if (!watcher.active())
+                loader.configure(config, loader_interval());
+        }
+
+        if (night_mode)
+        {
+            // 分が変わったときだけ描き直す
+            if (dirty || t_frame / 60 != last_drawn_time / 60)
+            {
+                offscreen->Fill(0, 0, 0);
+                if (!config.night_blank)
+                {
+                    char night_buffer[6];
+                    std::strftime(night_buffer, sizeof(night_buffer), "%H:%M", &tm_frame);
+                    draw_text(offscreen, *font, layout.clock_x, layout.ticker_baseline,
+                              ToMatrixColor(COL_WHITE), night_buffer);
                 }
-                current_row++;
+                offscreen = matrix->SwapOnVSync(offscreen);
+                frames_shown++;
+                last_drawn_time = t_frame;
+                dirty = false;
             }
+
+            // 夜間の時計は点滅せず分だけを表示し、夜間の終わりも分単位で判定するので、
+            // 次に起きるのは壁時計の次の分境界
+            auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+            auto to_next_min = std::chrono::milliseconds(60000) -
+                               std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch) % 60000;
+            wait_until(std::min(next_frame_deadline(LAYER_NONE, now, timers), now + to_next_min));
+            continue;
+        }
+
+        // --- 描画切替 (5秒ごと) ---
+        if (std::chrono::duration_cast<std::chrono::seconds>(now - timers.last_toggle).count() >= config.toggle_seconds)
+        {
+            show_alternate_display = !show_alternate_display;
+            timers.last_toggle = now;
+            dirty = true;
+        }
+
+        // --- ページ切替 (方面が表示行数より多いとき) ---
+        if (pages.stale || t_frame / 60 != pages.minute)
+        {
+            TraceScope trace("render_pages", "render");
+            render_pages(pages, current_data.board.rows, layout, *font, t_frame);
+            page_index = std::min(page_index, pages.pages - 1);
+            dirty = true;
+        }
+        if (pages.pages > 1 &&
+            std::chrono::duration_cast<std::chrono::seconds>(now - timers.last_page).count() >= config.page_seconds)
+        {
+            page_index = (page_index + 1) % pages.pages;
+            timers.last_page = now;
+            dirty = true;
+        }
+
+        // --- 動いているレイヤーの判定 ---
+        // メッセージが1件だけで時計の左に収まるならスクロールせず静止表示する
+        TickerScheduler &ticker = current_data.ticker;
+        bool ticker_static = ticker.messages.size() == 1 && !ticker.messages[0].removed &&
+                             ticker.messages[0].width <= layout.ticker_width;
+        unsigned active_layers = LAYER_COLON | LAYER_FACE;
+        if (pages.pages > 1)
+            active_layers |= LAYER_PAGE;
+        if (pages.has_marquee(page_index, show_alternate_display))
+        {
+            active_layers |= LAYER_MARQUEE;
+            dirty = true;
+        }
+        if (!ticker.messages.empty() && !ticker_static)
+        {
+            active_layers |= LAYER_TICKER;
+            dirty = true;
+        }
+
+        // 秒が変わったら時計(コロン・残り分数)を更新
+        if (t_frame != last_drawn_time)
+            dirty = true;
+
+        if (!dirty)
+        {
+            wait_until(next_frame_deadline(active_layers, now, timers));
+            continue;
         }
+        last_drawn_time = t_frame;
+        dirty = false;
+
+        // --- 2. 描画クリア ---
+        TraceScope draw_trace("draw", "render");
+        offscreen->Fill(0, 0, 0);
+
+        // --- 3. 発車情報描画 (事前に描いたページをコピー) ---
+        pages.face(page_index, show_alternate_display).blit(offscreen, 0, 0);
+        auto face_shown = std::max(timers.last_toggle, timers.last_page);
+        pages.draw_marquees(offscreen, page_index, show_alternate_display,
+                            std::chrono::duration_cast<std::chrono::milliseconds>(now - face_shown).count());
 
         // --- 4. 現在時刻描画 (右下 y=31付近) ---
-        std::time_t t_now_disp = std::time(nullptr);
+        std::time_t t_now_disp = t_frame;
         std::tm tm_now_disp = *std::localtime(&t_now_disp);
 
         // 奇数秒はコロンあり、偶数秒はコロンなし(スペース)
@@ -400,45 +4344,110 @@ int main(int argc, char *argv[])
         {
             std::strftime(time_buffer, sizeof(time_buffer), "%H %M", &tm_now_disp); // 偶数秒
         }
-        std::string current_time_str(time_buffer);
 
         // --- 5. スクロールメッセージ描画 (最下段 y=31付近) ---
-        if (!current_data.scroll_messages.empty())
+        int ticker_height = layout.ticker_baseline - layout.ticker_top + 1;
+        bool blink_on = (t_frame % 2) != 0; // 点滅はコロンと同じ位相
+        if (config.ticker_ribbon && !ticker_static)
         {
-            if (msg_index >= current_data.scroll_messages.size())
-                msg_index = 0;
+            // 連続表示: メッセージと区切りを交互に帯へ流し込む
+            if (!ribbon.fits(layout.ticker_width, ticker_height) || ticker.messages.empty())
+                ribbon.reset(layout.ticker_width, ticker_height);
 
-            std::string &msg = current_data.scroll_messages[msg_index];
-            Color msg_col = ToMatrixColor(current_data.scroll_colors[msg_index]);
+            if (!ticker.messages.empty())
+            {
+                if (ribbon.in_message() && ticker.should_preempt(ribbon.fed(), now))
+                    ribbon.cut(); // 緊急メッセージの割り込み (単語境界で打ち切り)
 
-            rgb_matrix::DrawText(offscreen, font, scroll_x, 31, msg_col, NULL, msg.c_str(), 0);
+                if (ribbon.source_done())
+                {
+                    bool msg_started = false;
+                    if (ribbon.in_message())
+                    {
+                        ticker.finish_current();
+                        ribbon.load(*font, separator_run, ticker.spans, COL_WHITE, ticker_height - 1, false);
+                    }
+                    else if (TickerMessage *msg = ticker.current_message(now, msg_started))
+                    {
+                        ribbon.load(*font, msg->run, ticker.spans, msg->color, ticker_height - 1, true);
+                    }
+                }
+                ribbon.advance();
+                ribbon.draw(offscreen, 0, layout.ticker_top, blink_on);
+            }
+        }
+        else
+        {
+            if (config.ticker_ribbon)
+                ribbon.reset(layout.ticker_width, ticker_height); // 静止表示から戻ったら空の帯から流す
 
-            scroll_x--;
+            bool msg_started = false;
+            TickerMessage *msg = ticker.current_message(now, msg_started);
+            if (msg_started)
+                scroll_x = layout.width;
 
-            if (scroll_x < -((int)msg.size() * 6))
+            if (msg != nullptr)
             {
-                msg_index++;
-                scroll_x = matrix->width();
+                Color msg_col = ToMatrixColor(msg->color);
+
+                if (ticker_static)
+                {
+                    draw_run_clipped(offscreen, *font, msg->run, ticker.spans, 0, layout.ticker_baseline, msg_col, 0, layout.clock_x, blink_on);
+                    ticker.finish_current();
+                }
+                else
+                {
+                    draw_run_clipped(offscreen, *font, msg->run, ticker.spans, scroll_x, layout.ticker_baseline, msg_col, 0, layout.clock_x, blink_on);
+
+                    scroll_x--;
+
+                    // 緊急メッセージの割り込み (単語境界で打ち切り) またはスクロールアウトで次へ
+                    if (ticker.should_preempt(layout.width - scroll_x, now) || scroll_x < -msg->width)
+                        ticker.finish_current();
+                }
             }
         }
 
         // 現在時刻の背景クリアと描画
-        int time_x_pos = matrix->width() - 28;
-        for (int clear_y = 22; clear_y <= 31; ++clear_y)
+        for (int clear_y = layout.ticker_top; clear_y <= layout.ticker_baseline; ++clear_y)
         {
-            rgb_matrix::DrawLine(offscreen, time_x_pos - 1, clear_y, matrix->width(), clear_y, ToMatrixColor(COL_BLACK));
+            rgb_matrix::DrawLine(offscreen, layout.clock_x - 1, clear_y, layout.width, clear_y, ToMatrixColor(COL_BLACK));
         }
-        rgb_matrix::DrawText(offscreen, font, time_x_pos, 31, ToMatrixColor(COL_WHITE), NULL, current_time_str.c_str(), 0);
+        draw_text(offscreen, *font, layout.clock_x, layout.ticker_baseline, ToMatrixColor(COL_WHITE), time_buffer);
+
+        // 区切り線 (フォントの1pxのはみ出しを消す)
+        for (int sep_y : layout.separator_ys)
+            rgb_matrix::DrawLine(offscreen, 0, sep_y, layout.width, sep_y, ToMatrixColor(COL_BLACK));
 
-        // 区切り線
-        rgb_matrix::DrawLine(offscreen, 0, 10, matrix->width(), 10, ToMatrixColor(COL_BLACK));
-        rgb_matrix::DrawLine(offscreen, 0, 21, matrix->width(), 21, ToMatrixColor(COL_BLACK));
+        draw_trace.end();
 
-        // --- 6. 表示更新 ---
+        // --- 6. 表示更新 (パネル更新スレッドが前のフレームを手放すまで待つ) ---
+        TraceScope swap_trace("swap", "render");
         offscreen = matrix->SwapOnVSync(offscreen);
-        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        swap_trace.end();
+        frames_shown++;
+        auto frame_time = std::chrono::steady_clock::now() - now;
+        metrics.frame_time.observe(frame_time);
+
+        // 予算を超えたフレームがあれば、そこまでの記録を書き出す
+        if (tracer.enabled() && config.trace_frame_budget_ms > 0 &&
+            frame_time > std::chrono::milliseconds(config.trace_frame_budget_ms) &&
+            now - last_trace_dump >= std::chrono::seconds(TRACE_DUMP_MIN_INTERVAL_SECONDS))
+        {
+            last_trace_dump = now;
+            slow_frame_traced = true;
+        }
+
+        waited_for_scroll = (active_layers & LAYER_TICKER) != 0;
+        wait_until(next_frame_deadline(active_layers, now, timers));
     }
 
+    loader.stop();
+    tracer.wait_writer();
     delete matrix;
+#ifdef ALLOC_CHECK
+    return alloc_check.report();
+#else
     return 0;
+#endif
 }
\ No newline at end of file
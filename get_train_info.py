@@ -40,6 +40,40 @@ TRAIN_TYPES = [
 COMPANY_NAMES = [
     'ＪＲ', 'JR', '東京メトロ', '都営', '京王', '小田急', '京急', '京成', '東武', '西武', '東急'
 ]
+# 運行情報で路線名を描く色 (おおよその路線カラー)。表示名に含まれる名前のうち長いものを優先
+LINE_COLORS = {
+    '山手線': '#9ACD32', '京浜東北線': '#00B2E5', '中央線': '#F15A22', '中央・総武': '#FFD400',
+    '総武線': '#FFD400', '南武線': '#FFD400', '横浜線': '#7AC143', '埼京線': '#00AC9A',
+    '青梅線': '#F15A22', '東海道線': '#F68B1E', '湘南新宿ライン': '#E21F26',
+    '小田原線': '#2288CC', '江ノ島線': '#2288CC', '多摩線': '#2288CC',
+    '京王線': '#DD0077', '井の頭線': '#1A6FC4', '東横線': '#DA0442', '田園都市線': '#20A288',
+    '銀座線': '#FF9500', '丸ノ内線': '#F62E36', '日比谷線': '#B5B5AC', '東西線': '#009BBF',
+    '千代田線': '#00BB85', '有楽町線': '#C1A470', '半蔵門線': '#8F76D6', '南北線': '#00AC9B',
+    '副都心線': '#9C5E31',
+}
+
+
+def find_line_color(route_name: str):
+    """路線の表示名から路線カラーを探す (見つからなければ None)"""
+    for key in sorted(LINE_COLORS, key=len, reverse=True):
+        if key in route_name:
+            return LINE_COLORS[key]
+    return None
+
+
+def build_message_spans(label: str, label_color: str, name: str, detail: str, blink: bool = False) -> list:
+    """
+    表示用の装飾付きメッセージを作る (draw_matrix がそのまま帯に描く)
+    例: 【遅延】(黄) 路線名(路線カラー) : 詳細(白)
+    """
+    label_span = {'text': label, 'color': label_color}
+    if blink:
+        label_span['style'] = 'blink'
+    return [
+        label_span,
+        {'text': ' ' + name, 'color': find_line_color(name) or label_color},
+        {'text': ': ' + detail, 'color': 'white'},
+    ]
 
 # --- 運行情報クラス ---
 class NowTrainInfomation:
@@ -67,10 +101,13 @@ class NowTrainInfomation:
             entry = {'name': name, 'detail': detail, 'company': company}
 
             if status in ["運転状況", "運転情報", "列車遅延", "運転再開"]:
+                entry['spans'] = build_message_spans('【遅延】', 'yellow', name, detail)
                 delay_list.append(entry)
             elif status == "運転見合わせ":
+                entry['spans'] = build_message_spans('【運転見合わせ】', 'red', name, detail, blink=True)
                 suspend_list.append(entry)
             else:
+                entry['spans'] = build_message_spans('【お知らせ】', 'cyan', name, detail)
                 trouble_list.append(entry)
         
         return suspend_list, delay_list, trouble_list
@@ -7,6 +7,8 @@ import datetime
 import json
 import os
 import sys
+import select
+import struct
 import subprocess
 import get_train_info
 import get_weather_info
@@ -19,6 +21,7 @@ FIRST_LAST_INFO_FILE = os.path.join(INFO_DIR, "first_last_train.json")
 WEATHER_INFO_FILE = os.path.join(INFO_DIR, "weather_forecast.json")
 
 # 駅設定（from: 設定する駅, to: 上下線の列車が向かう先の例を2つ記入する）
+# 表示行数より多く記入した場合、draw_matrix はページを切り替えて全方面を表示する
 STATIONS_CONFIG = {
     "from": "登戸",
     "to": ["新宿", "町田"]
@@ -26,6 +29,17 @@ STATIONS_CONFIG = {
 
 # C++プログラムのパス
 DRAW_PROGRAM_PATH = "./draw_matrix"
+DRAW_CONFIG_FILE = "draw_matrix_config.json"
+
+# 描画プロセスの監視
+HEARTBEAT_FORMAT = "<IIIIQQQ"    # draw_matrix.cc の HeartbeatPage と同じ配置
+HEARTBEAT_MAGIC = 0x42484d44     # "DMHB"
+HEARTBEAT_VERSION = 1
+HEARTBEAT_STARTUP_GRACE = 20.0   # 起動から最初の生存確認が届かなければ警告するまでの時間(秒)
+HEARTBEAT_HANG_GRACE = 5.0       # 予定時刻を過ぎてからハングとみなすまでの猶予(秒)
+SUPERVISOR_POLL_SECONDS = 0.5    # 生存確認を読む間隔
+RESTART_STABLE_SECONDS = 30.0    # これより長く動いていれば連続クラッシュの回数を戻す
+RESTART_BACKOFF_MAX = 30.0       # 連続クラッシュ時の再起動待ちの上限(秒)
 
 # --- グローバル変数 ---
 search_thread = None
@@ -60,6 +74,147 @@ def read_json(filepath):
     except:
         return None
 
+# --- 描画プロセスの監視 ---
+def heartbeat_path():
+    """ draw_matrix の設定から生存確認の共有メモリのパスを得る（使わない設定なら None） """
+    try:
+        with open(DRAW_CONFIG_FILE, 'r', encoding='utf-8') as f:
+            name = json.load(f).get("control", {}).get("heartbeat", "")
+    except (OSError, ValueError, AttributeError):
+        name = ""
+    return os.path.join("/dev/shm", name) if name else None
+
+def read_heartbeat(path):
+    """ (pid, beat_ns, expect_by_ns, frames) を返す。読めなければ None """
+    size = struct.calcsize(HEARTBEAT_FORMAT)
+    try:
+        fd = os.open(path, os.O_RDONLY)
+    except OSError:
+        return None
+    try:
+        for _ in range(3):
+            data = os.pread(fd, size, 0)
+            if len(data) < size:
+                return None
+            magic, version, seq, pid, beat_ns, expect_by_ns, frames = struct.unpack(HEARTBEAT_FORMAT, data)
+            if magic != HEARTBEAT_MAGIC or version != HEARTBEAT_VERSION:
+                return None
+            # seq が偶数で読む前後で変わっていなければ、書き込みの途中を読んでいない
+            seq_after = struct.unpack("<I", os.pread(fd, 4, 8))[0]
+            if seq % 2 == 0 and seq == seq_after:
+                return pid, beat_ns, expect_by_ns, frames
+        return None
+    finally:
+        os.close(fd)
+
+class RendererSupervisor:
+    """ 描画プロセスを起動して見張る。
+    終了は pidfd（使えなければ waitpid）ですぐに検出し、生存確認が途絶えたらハングとみなして止める。
+    draw_matrix は共有メモリを作れなくても表示を続けるので、ハングの判定は起動後に最初の生存確認が
+    届いてから行う（届かないうちは警告するだけで止めない）。
+    短時間で落ち続けるときは再起動の間隔を延ばす """
+
+    def __init__(self, command):
+        self.command = command
+        self.process = None
+        self.pidfd = None
+        self.started = 0.0      # time.monotonic()
+        self.failures = 0       # 連続クラッシュ回数
+        self.beat_pid = None    # 今回の起動で生存確認を書いている pid（まだ届いていなければ None）
+        self.beat_warned = False
+        self.heartbeat = heartbeat_path()
+        self.stop_event = threading.Event()
+        self.thread = threading.Thread(target=self._run, daemon=True)
+
+    def start(self):
+        self._launch()
+        self.thread.start()
+
+    def stop(self):
+        self.stop_event.set()
+        self.thread.join(timeout=SUPERVISOR_POLL_SECONDS * 2)
+        if self.process and self.process.poll() is None:
+            subprocess.run(["sudo", "kill", str(self.process.pid)])
+
+    def _launch(self):
+        print(f"Launching C++ renderer: {DRAW_PROGRAM_PATH}")
+        self.process = subprocess.Popen(self.command, cwd=os.getcwd())
+        self.started = time.monotonic()
+        self.beat_pid = None
+        self.beat_warned = False
+        if self.pidfd is not None:
+            os.close(self.pidfd)
+        try:
+            self.pidfd = os.pidfd_open(self.process.pid)
+        except (AttributeError, OSError):
+            self.pidfd = None # Python 3.9 未満 / Linux 5.3 未満
+
+    def _wait_exit(self, timeout):
+        """ timeout 秒まで終了を待つ。終了していれば True """
+        if self.pidfd is not None:
+            poller = select.poll()
+            poller.register(self.pidfd, select.POLLIN)
+            if not poller.poll(timeout * 1000):
+                return False
+        try:
+            self.process.wait(timeout=None if self.pidfd is not None else timeout)
+            return True
+        except subprocess.TimeoutExpired:
+            return False
+
+    def _renderer_pid(self, beat):
+        """ 止める相手の pid（sudo の子の draw_matrix） """
+        if beat:
+            return beat[0]
+        try:
+            with open(f"/proc/{self.process.pid}/task/{self.process.pid}/children") as f:
+                children = f.read().split()
+            if children:
+                return int(children[0])
+        except (OSError, ValueError):
+            pass
+        return self.process.pid
+
+    def _check_hang(self):
+        if not self.heartbeat:
+            return
+        beat = read_heartbeat(self.heartbeat)
+        started_ns = int(self.started * 1e9)
+        if beat and beat[1] < started_ns:
+            beat = None # 前のプロセスが残したもの
+        if beat and self.beat_pid is None:
+            self.beat_pid = beat[0]
+        if self.beat_pid is None:
+            if not self.beat_warned and time.monotonic() - self.started > HEARTBEAT_STARTUP_GRACE:
+                print(f"Warning: No heartbeat from renderer in {self.heartbeat}. Hang detection is off until one arrives.")
+                self.beat_warned = True
+            return
+        if not beat or beat[0] != self.beat_pid:
+            return # 読めないときは判定しない（終了は pidfd で検出する）
+        hung = time.monotonic_ns() > beat[2] + HEARTBEAT_HANG_GRACE * 1e9
+        if hung:
+            pid = self._renderer_pid(beat)
+            print(f"Warning: Renderer (pid {pid}) stopped responding. Killing...")
+            subprocess.run(["sudo", "kill", "-KILL", str(pid)])
+
+    def _run(self):
+        while not self.stop_event.is_set():
+            if not self._wait_exit(SUPERVISOR_POLL_SECONDS):
+                self._check_hang()
+                continue
+            if self.stop_event.is_set():
+                break
+
+            uptime = time.monotonic() - self.started
+            self.failures = self.failures + 1 if uptime < RESTART_STABLE_SECONDS else 1
+            # 1回目はすぐに、続けて落ちるときは 0.5, 1, 2, ... 秒待つ
+            delay = 0.0 if self.failures <= 1 else min(RESTART_BACKOFF_MAX, 0.5 * 2 ** (self.failures - 2))
+            print(f"Warning: Renderer process exited (code {self.process.returncode}, up {uptime:.1f}s). "
+                  f"Restarting in {delay:.1f}s...")
+            if self.stop_event.wait(delay):
+                break
+            self._launch()
+
 # --- タスク関数群 ---
 def search_first_last_trains_task():
     print("Searching first/last trains...")
@@ -242,12 +397,9 @@ def main_loop():
     global search_thread, is_first_last_train_updated_today
     print("Starting main loop (Data Fetcher)...")
     
-    # C++の描画プロセスを起動
-    print(f"Launching C++ renderer: {DRAW_PROGRAM_PATH}")
-    renderer_process = subprocess.Popen(
-        ["sudo", DRAW_PROGRAM_PATH],
-        cwd=os.getcwd()
-    )
+    # C++の描画プロセスを起動（終了・ハングは監視スレッドが検出して再起動する）
+    renderer = RendererSupervisor(["sudo", DRAW_PROGRAM_PATH])
+    renderer.start()
     
     # 起動時の時刻でフラグを初期化
     initial_now = get_current_time()
@@ -264,11 +416,6 @@ def main_loop():
         while True:
             now = get_current_time()
             
-            # C++プロセスが死んでいたら再起動
-            if renderer_process.poll() is not None:
-                print("Warning: Renderer process died. Restarting...")
-                renderer_process = subprocess.Popen(["sudo", DRAW_PROGRAM_PATH], cwd=os.getcwd())
-
             # 1. 始発・終電の更新チェック (午前3時)
             if now.hour == 3 and not is_first_last_train_updated_today:
                 print("It's 3 AM. Triggering daily first/last train info update...")
@@ -296,12 +443,10 @@ def main_loop():
 
     except KeyboardInterrupt:
         print("Stopping...")
-        if renderer_process.poll() is None:
-            subprocess.run(["sudo", "kill", str(renderer_process.pid)])
+        renderer.stop()
     except Exception as e:
         print(f"Main loop error: {e}")
-        if renderer_process.poll() is None:
-            subprocess.run(["sudo", "kill", str(renderer_process.pid)])
+        renderer.stop()
 
 if __name__ == "__main__":
     create_info_dir()